@@ -0,0 +1,144 @@
+#!/bin/sh
+#
+# Build a fake sysfs/devfs tree for running lsnvme without NVMe hardware:
+#
+#	mkfixture.sh DIR CTRLS NAMESPACES [PARTITIONS]
+#
+# creates DIR/sys with CTRLS controllers, each with NAMESPACES namespaces
+# of PARTITIONS partitions, an empty DIR/dev and the IRQ affinities of
+# DIR/proc. The host has two NUMA nodes of four CPUs, controllers alternate
+# between them and each has two hardware queues, one per node. The second
+# queue of odd controllers has its interrupt steered to node 0. Point lsnvme
+# at it with
+#
+#	lsnvme -B sysfs --sysfs=DIR/sys --devfs=DIR/dev --procfs=DIR/proc
+#
+# Only the attributes lsnvme reads are created. Everything is written with
+# shell builtins so 10k namespaces take seconds, not minutes.
+
+set -e
+
+if [ $# -lt 3 ]; then
+	echo "usage: $0 DIR CTRLS NAMESPACES [PARTITIONS]" >&2
+	exit 1
+fi
+
+dir=$1
+nr_ctrl=$2
+nr_ns=$3
+nr_part=${4:-0}
+
+rm -rf "$dir"
+sys=$dir/sys
+mkdir -p "$sys/class/nvme" "$sys/block" "$sys/kernel" \
+	"$sys/bus/pci/drivers/nvme" "$dir/dev" "$dir/proc/irq" \
+	"$sys/devices/system/node/node0" "$sys/devices/system/node/node1"
+echo 1 > "$sys/kernel/uevent_seqnum"
+echo 0-3 > "$sys/devices/system/node/node0/cpulist"
+echo 4-7 > "$sys/devices/system/node/node1/cpulist"
+echo "10 21" > "$sys/devices/system/node/node0/distance"
+echo "21 10" > "$sys/devices/system/node/node1/distance"
+
+minor=0
+c=0
+while [ $c -lt "$nr_ctrl" ]; do
+	bdf=$(printf '0000:%02x:%02x.0' $((c / 32 + 1)) $((c % 32)))
+	pci=$sys/devices/pci0000:00/$bdf
+	ctrl=$pci/nvme/nvme$c
+
+	mkdir -p "$ctrl"
+	echo "pci:v00008086d00000953sv00008086sd00003702bc01sc08i02" \
+		> "$pci/modalias"
+	ln -s ../../../bus/pci/drivers/nvme "$pci/driver"
+	ln -s ../../../bus/pci "$pci/subsystem"
+	echo $((c % 2)) > "$pci/numa_node"
+	echo $((c % 2 * 4))-$((c % 2 * 4 + 3)) > "$pci/local_cpulist"
+
+	# vector 0: admin queue, 1 and 2: I/O queues on node 0 and 1
+	mkdir "$pci/msi_irqs"
+	for v in 0 1 2; do
+		irq=$((32 + c * 3 + v))
+		echo msix > "$pci/msi_irqs/$irq"
+		mkdir "$dir/proc/irq/$irq"
+	done
+	echo 0-7 > "$dir/proc/irq/$((32 + c * 3))/effective_affinity_list"
+	echo 0-3 > "$dir/proc/irq/$((33 + c * 3))/effective_affinity_list"
+	if [ $((c % 2)) -eq 1 ]; then
+		echo 0-3 > "$dir/proc/irq/$((34 + c * 3))/effective_affinity_list"
+	else
+		echo 4-7 > "$dir/proc/irq/$((34 + c * 3))/effective_affinity_list"
+	fi
+
+	echo "241:$c" > "$ctrl/dev"
+	echo "LSNVME FIXTURE $c" > "$ctrl/model"
+	printf 'FX%08d\n' $c > "$ctrl/serial"
+	echo "1.0" > "$ctrl/firmware_rev"
+	echo $c > "$ctrl/cntlid"
+	ln -s ../../../$bdf "$ctrl/device"
+	ln -s ../../devices/pci0000:00/$bdf/nvme/nvme$c "$sys/class/nvme/nvme$c"
+
+	n=1
+	while [ $n -le "$nr_ns" ]; do
+		name=nvme${c}n$n
+		disk=$ctrl/$name
+
+		mkdir "$disk"
+		echo "259:$minor" > "$disk/dev"
+		echo 2097152 > "$disk/size"
+		echo $n > "$disk/nsid"
+		mkdir -p "$disk/mq/0" "$disk/mq/1" "$disk/queue"
+		echo 0-3 > "$disk/mq/0/cpu_list"
+		echo 4-7 > "$disk/mq/1/cpu_list"
+
+		# the second namespace of every controller is mistuned
+		q=$disk/queue
+		if [ $n -eq 2 ]; then
+			echo "none [mq-deadline] kyber" > "$q/scheduler"
+			echo 128 > "$q/max_sectors_kb"
+		else
+			echo "[none] mq-deadline kyber" > "$q/scheduler"
+			echo 512 > "$q/max_sectors_kb"
+		fi
+		echo 1023 > "$q/nr_requests"
+		echo 512 > "$q/max_hw_sectors_kb"
+		echo 1 > "$q/rq_affinity"
+		echo 0 > "$q/nomerges"
+		echo 0 > "$q/add_random"
+		echo 0 > "$q/rotational"
+		echo "write back" > "$q/write_cache"
+		echo 0 > "$q/io_poll"
+		echo 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 > "$disk/stat"
+
+		# debugfs counters, hardware queue 0 takes 90% of the traffic
+		dbg=$sys/kernel/debug/block/$name
+		mkdir -p "$dbg/hctx0" "$dbg/hctx1"
+		echo 9000 > "$dbg/hctx0/queued"
+		echo 1000 > "$dbg/hctx1/queued"
+		for h in 0 1; do
+			echo 500 > "$dbg/hctx$h/run"
+			printf '%8u\t%u\n' 0 10 1 400 2 50 4 0 8 0 16 0 32 0 \
+				64 0 > "$dbg/hctx$h/dispatched"
+			printf '%8u+\t%u\n' 128 0 >> "$dbg/hctx$h/dispatched"
+			: > "$dbg/hctx$h/busy"
+		done
+		ln -s ../devices/pci0000:00/$bdf/nvme/nvme$c/$name \
+			"$sys/block/$name"
+		minor=$((minor + 1))
+
+		p=1
+		while [ $p -le "$nr_part" ]; do
+			mkdir "$disk/${name}p$p"
+			echo "259:$minor" > "$disk/${name}p$p/dev"
+			echo $p > "$disk/${name}p$p/partition"
+			echo 1024 > "$disk/${name}p$p/size"
+			echo 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 \
+				> "$disk/${name}p$p/stat"
+			minor=$((minor + 1))
+			p=$((p + 1))
+		done
+
+		n=$((n + 1))
+	done
+
+	c=$((c + 1))
+done
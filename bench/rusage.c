@@ -0,0 +1,102 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * rusage [-n RUNS] command [args..]
+ *
+ * Run a command RUNS times (default 5) with stdout sent to /dev/null and
+ * print the best and median wall clock time and the largest peak RSS.
+ * A stand-in for /usr/bin/time, which is not installed everywhere.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+static int dbl_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec t0, t1;
+	struct rusage ru;
+	long maxrss = 0;
+	double *ms;
+	int i, runs = 5, status, fd;
+	pid_t pid;
+
+	if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+		runs = atoi(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+
+	if (argc < 2 || runs < 1) {
+		fprintf(stderr, "usage: rusage [-n RUNS] command [args..]\n");
+		return EXIT_FAILURE;
+	}
+
+	ms = calloc(runs, sizeof(*ms));
+	if (!ms)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < runs; ++i) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return EXIT_FAILURE;
+		}
+		if (pid == 0) {
+			fd = open("/dev/null", O_WRONLY);
+			if (fd >= 0)
+				dup2(fd, STDOUT_FILENO);
+			execvp(argv[1], &argv[1]);
+			perror(argv[1]);
+			_exit(127);
+		}
+
+		if (wait4(pid, &status, 0, &ru) < 0) {
+			perror("wait4");
+			return EXIT_FAILURE;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "%s failed\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+
+		ms[i] = (t1.tv_sec - t0.tv_sec) * 1e3 +
+			(t1.tv_nsec - t0.tv_nsec) / 1e6;
+		if (ru.ru_maxrss > maxrss)
+			maxrss = ru.ru_maxrss;
+	}
+
+	qsort(ms, runs, sizeof(*ms), dbl_cmp);
+	printf("%10.2f ms best %10.2f ms median %8ld KiB peak RSS\n",
+	       ms[0], ms[runs / 2], maxrss);
+
+	free(ms);
+	return EXIT_SUCCESS;
+}
@@ -18,23 +18,36 @@
 #include <ctype.h>
 #include <getopt.h>
 #include <string.h>
+#include <stdarg.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <limits.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <mntent.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <endian.h>
 
 #include <libudev.h>
+#include <linux/io_uring.h>
 
 // these are moving around
 #include <linux/nvme.h>
 //#include <uapi/linux/nvme_ioctl.h>
 
+#include "lsnvme_snap.h"
+
 #define TAB "  "
 #define TEE "├─"
 #define ELB "└─"
@@ -42,9 +55,25 @@
 static const char NVME[] = "nvme";
 static const char *SYS = "/sys";
 static const char *DEV = "/dev";
+static const char *PROC = "/proc";
+static const char *DEBUGFS;	/* NULL: not mounted */
 
 static struct udev *udev;
 
+enum {
+	FMT_TEXT,
+	FMT_KV,
+	FMT_JSON,
+	FMT_CSV,
+	FMT_BIN,
+};
+
+enum {
+	BACKEND_AUTO,	/* sysfs with --sysfs, udev otherwise */
+	BACKEND_UDEV,
+	BACKEND_SYSFS,
+};
+
 enum {
 	SZ_B,
 	SZ_KB,
@@ -61,16 +90,76 @@ static struct options {
 	bool disp_ctrl;
 	bool disp_devs;
 	bool disp_tree;
-	bool disp_machine;
+	int format;
 	int headers;
+	unsigned int jobs;
+	bool active_ns;
+	int backend;
+	const char *cache_dir;
+	int refresh;
+	bool watch;
+	double smart_interval;
+	const char *sys_root;
+	const char *dev_root;
+	unsigned int probe_reads;
+	double qd_secs;
+	bool admin_stats;
+	unsigned int admin_loop;
+	unsigned int timeout_ms;
+	double deadline;
+	unsigned int ctrl_inflight;
+	unsigned int host_inflight;
+	double rate;
+	double burst;
+	double spread;
+	bool errors;
+	int firmware;
+	bool power;
+	bool lbaf;
+	bool topology;
+	const char *proc_root;
+	bool tuning;
+	const char *tune_profile;
+	double iostat_interval;
+	bool hctx;
 } opts = {
 	SZ_AUTO,	/* determine size */
 	0,		/* verbosity */
 	false,		/* display controllers */
 	true,		/* display block devs */
 	false,		/* display as tree */
-	false,		/* machine readable output */
+	FMT_TEXT,	/* output format */
 	0,		/* print headers */
+	64,		/* max identify worker threads */
+	false,		/* discover namespaces with Identify */
+	BACKEND_AUTO,	/* enumeration backend */
+	NULL,		/* Identify cache directory */
+	0,		/* ignore cached Identify data */
+	false,		/* follow udev events after listing */
+	0,		/* SMART polling interval, 0: off */
+	NULL,		/* sysfs root, default: from /proc/mounts */
+	NULL,		/* devfs root, default: from /proc/mounts */
+	0,		/* reads per namespace for --probe-latency */
+	0,		/* seconds per --qd-sweep step, 0: off */
+	false,		/* print admin command round trip histograms */
+	0,		/* admin commands per controller in loop mode */
+	0,		/* per admin command deadline, 0: driver default */
+	0,		/* seconds all admin commands must finish in, 0: none */
+	0,		/* admin commands in flight per controller, 0: any */
+	0,		/* admin commands in flight on the host, 0: any */
+	0,		/* admin commands per second, 0: unlimited */
+	0,		/* token bucket depth, default: one second of rate */
+	0,		/* seconds to spread controllers over, 0: all at once */
+	false,		/* print new Error Information log entries */
+	-1,		/* firmware slot view, -1: off */
+	false,		/* power states and APST */
+	false,		/* LBA format audit */
+	false,		/* queue, CPU and IRQ placement */
+	NULL,		/* procfs root, NULL: /proc */
+	false,		/* audit block queue settings */
+	NULL,		/* tuning profile, NULL: built in */
+	0,		/* block layer statistics interval, 0: off */
+	false,		/* per hardware queue counters */
 };
 
 static struct size_spec {
@@ -86,23 +175,230 @@ static struct size_spec {
 };
 
 /*
- * TODO: make this char buffer the correct size
+ * Enumeration is split in three phases: controllers and the block devices
+ * below them are collected on the main thread (libudev is not thread
+ * safe), the Identify commands are fanned out to a pool of workers, and
+ * everything is printed in enumeration order afterwards. Rows only carry
+ * plain strings so either backend can fill them in.
  */
-static char *read_str(const char *path)
+struct lsnvme_ns {
+	struct udev_device *dev;	/* udev backend only */
+	const char *sysname;
+	const char *sysnum;
+	const char *devnode;	/* NULL: active but no block device */
+	const char *devtype;
+	const char *vendor;
+	const char *model;
+	const char *rev;
+	long long sectors;	/* -1 if unknown */
+	dev_t devnum;		/* of the block device, 0 if there is none */
+	dev_t ctrl_devnum;	/* admin commands go to the controller */
+	const char *ctrl_devnode;
+	const char *ctrl_sysnum;
+	const char *ctrl_sn;	/* Identify cache key */
+	const char *ctrl_fr;
+	const char *ctrl_cntlid;
+	const char *disk_sysnum;	/* partitions only */
+	uint32_t nsid;		/* of the namespace a partition lives on */
+	unsigned int partno;
+	bool is_part;
+	int id_ret;
+	struct nvme_id_ns *id;
+	struct lsnvme_probe *probe;
+};
+
+struct lsnvme_ctrl {
+	struct udev_device *dev;	/* udev backend only */
+	const char *sysname;
+	const char *sysnum;
+	const char *devnode;
+	const char *vendor;
+	const char *model;
+	const char *subsystem;	/* bus of the parent device */
+	const char *driver;
+	const char *mn;		/* sysfs model, serial and firmware_rev */
+	const char *sn;
+	const char *fr;
+	const char *cntlid;	/* tells controllers of one subsystem apart */
+	dev_t devnum;
+	int id_ret;
+	struct nvme_id_ctrl *id;
+	struct lsnvme_ns *ns;
+	unsigned int nr_ns;
+	int list_ret;
+	uint32_t *active;	/* Identify Active Namespace List */
+	unsigned int nr_active;
+	int smart_ret, smart_prev_ret;
+	struct nvme_smart_log *smart[2];	/* current, previous */
+	int err_ret;
+	uint64_t err_count;	/* error_count of the newest entry */
+	uint64_t err_lost;	/* new entries that fell out of the log */
+	struct nvme_error_log_page *errs;	/* new entries, newest first */
+	unsigned int nr_errs;
+	int fw_ret;
+	struct nvme_firmware_log_page *fw;
+	int pm_ret;
+	uint32_t ps;		/* current power state */
+	int apst_ret;
+	bool apste;		/* APST enabled */
+	struct nvme_auto_pst *apst;	/* one entry per power state */
+};
+
+static struct lsnvme_ctrl *ctrls;
+static unsigned int nr_ctrls;
+static unsigned int next_ctrl;	/* next controller handed to a worker */
+
+/* make room for element nr in an array grown by doubling */
+static void *array_grow(void *base, unsigned int nr, size_t size)
 {
-	static char read_str[32] = {0};
-	int fd = open(path, O_RDONLY|O_NONBLOCK);
+	if (nr & (nr - 1))
+		return base;
 
-	if (fd < 0)
+	return realloc(base, (nr ? nr * 2 : 1) * size);
+}
+
+/*
+ * String arena: every string of the device model is interned here, so a
+ * model name or firmware revision shared by a thousand rows is stored
+ * once, rows only hold pointers, and everything is released together by
+ * arena_free() at exit. Strings are only interned from the main thread.
+ */
+#define ARENA_CHUNK	(64 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used, size;
+	char data[];
+};
+
+static struct {
+	struct arena_chunk *chunk;
+	const char **tab;	/* open addressing, power of two sized */
+	size_t tab_size;
+	size_t nr;
+} arena;
+
+static void *arena_alloc(size_t len)
+{
+	struct arena_chunk *c = arena.chunk;
+	size_t size;
+
+	len = (len + 7) & ~(size_t)7;
+	if (!c || c->size - c->used < len) {
+		size = len > ARENA_CHUNK ? len : ARENA_CHUNK;
+		c = malloc(sizeof(*c) + size);
+		if (!c)
+			return NULL;
+		c->size = size;
+		c->used = 0;
+		c->next = arena.chunk;
+		arena.chunk = c;
+	}
+
+	c->used += len;
+	return c->data + c->used - len;
+}
+
+static size_t intern_hash(const char *s)
+{
+	size_t h = 14695981039346656037ULL;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+
+	return h;
+}
+
+static bool intern_grow(void)
+{
+	size_t i, j, size = arena.tab_size ? arena.tab_size * 2 : 256;
+	const char **tab = calloc(size, sizeof(*tab));
+
+	if (!tab)
+		return false;
+
+	for (i = 0; i < arena.tab_size; ++i) {
+		if (!arena.tab[i])
+			continue;
+		for (j = intern_hash(arena.tab[i]) & (size - 1); tab[j];
+		     j = (j + 1) & (size - 1))
+			;
+		tab[j] = arena.tab[i];
+	}
+
+	free(arena.tab);
+	arena.tab = tab;
+	arena.tab_size = size;
+
+	return true;
+}
+
+/* the arena copy of s, NULL for NULL */
+static const char *intern(const char *s)
+{
+	size_t i, len;
+	char *copy;
+
+	if (!s)
 		return NULL;
 
-	if (read(fd, read_str, 32) < 0) {
-		close(fd);
+	if (arena.nr * 2 >= arena.tab_size && !intern_grow())
+		return NULL;
+
+	for (i = intern_hash(s) & (arena.tab_size - 1); arena.tab[i];
+	     i = (i + 1) & (arena.tab_size - 1))
+		if (strcmp(arena.tab[i], s) == 0)
+			return arena.tab[i];
+
+	len = strlen(s) + 1;
+	copy = arena_alloc(len);
+	if (!copy)
 		return NULL;
+	memcpy(copy, s, len);
+
+	arena.tab[i] = copy;
+	arena.nr++;
+
+	return copy;
+}
+
+static const char *intern_or_dash(const char *s)
+{
+	return s ? intern(s) : "-";
+}
+
+static void arena_free(void)
+{
+	struct arena_chunk *c, *next;
+
+	for (c = arena.chunk; c; c = next) {
+		next = c->next;
+		free(c);
 	}
 
+	free(arena.tab);
+	memset(&arena, 0, sizeof(arena));
+}
+
+/* read an attribute relative to dirfd, trailing whitespace stripped */
+static char *sysfs_read(int dirfd, const char *name, char *buf, size_t len)
+{
+	int fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC);
+	ssize_t n;
+
+	if (fd < 0)
+		return NULL;
+
+	n = read(fd, buf, len - 1);
 	close(fd);
-	return read_str;
+	if (n < 0)
+		return NULL;
+
+	while (n > 0 && isspace((unsigned char)buf[n - 1]))
+		--n;
+	buf[n] = 0;
+
+	return buf;
 }
 
 // search parents until grandfather for driver
@@ -172,310 +468,5833 @@ static int find_sz(unsigned long long total)
 	return s;
 }
 
-/*
- * Get size or return "-"
- * Max size supported right now is 36000 TB
- * TODO: support Terabyte size
- */
-static char *bd_size(struct udev_device *dev)
+/* parse a sysfs size attribute (512 byte sectors), -1 if unusable */
+static long long parse_sectors(const char *nptr)
 {
-	static char size_str[32];
-	char path[128];
-	char *nptr, *endptr;
 	unsigned long long int sectors;
-	double total;
-	int ret;
-
-	strncpy(path, udev_device_get_syspath(dev), 128);
-	strcat(path, "/size");
-
-	nptr = read_str(path);
+	char *endptr;
 
 	if (!nptr)
-		return "-";
+		return -1;
 
+	errno = 0;
 	sectors = strtoull(nptr, &endptr, 10);
 
 	// no valid digits || overflow
 	if ((sectors == 0 && nptr == endptr ) ||
 	    (sectors == ULLONG_MAX && errno == ERANGE))
-		return "-";
+		return -1;
 
 	// too big: ~1 >> 55
 	if (sectors > 0x7fffffffffffffULL)
+		return -1;
+
+	return sectors;
+}
+
+/*
+ * Get size or return "-", formatted into size_str of BD_SIZE_LEN bytes
+ * Max size supported right now is 36000 TB
+ * TODO: support Terabyte size
+ */
+#define BD_SIZE_LEN	32
+
+static const char *bd_size(long long sectors, char *size_str)
+{
+	unsigned long long int bytes;
+	double total;
+	int ret;
+
+	if (sectors < 0)
+		return "-";
+
+	bytes = (unsigned long long)sectors << 9;
+
+	if (opts.sz == SZ_AUTO)
+		opts.sz = find_sz(bytes);
+
+	if (opts.sz == SZ_B) {
+		ret = snprintf(size_str, BD_SIZE_LEN, "%llu", bytes);
+	} else {
+		total = (double)(bytes) / disk_sizes[opts.sz].div;
+		ret = snprintf(size_str, BD_SIZE_LEN, "%.2f%c",
+				total, disk_sizes[opts.sz].suffix);
+	}
+
+	if (ret >= BD_SIZE_LEN)
 		return "-";
 
-	sectors <<= 9;
+	return size_str;
+}
+
+/*
+ * Commands reach a device through a transport: the ioctl transport talks
+ * to the kernel driver, the mock transport (--mock) answers in-process so
+ * enumeration and the worker pool can be exercised at scale on a machine
+ * without NVMe hardware. Its made-up answers never go to the cache.
+ */
+struct lsnvme_handle;
+
+struct lsnvme_transport {
+	const char *name;
+	/* 0 or a positive errno */
+	int (*open)(struct lsnvme_handle *h, const char *devnode);
+	void (*close)(struct lsnvme_handle *h);
+	/* 0, the NVMe status of the command, or a positive errno */
+	int (*admin)(struct lsnvme_handle *h, struct nvme_admin_cmd *cmd);
+	int (*io)(struct lsnvme_handle *h, struct nvme_user_io *io);
+};
+
+#define ADMIN_HIST	32
+
+struct lsnvme_handle {
+	dev_t devnum;
+	int err;	/* errno if the open failed */
+	int fd;		/* ioctl transport */
+	void *priv;	/* other transports */
+	/* admin round trips, bucket b counts [2^(b-1), 2^b) microseconds */
+	uint64_t admin_hist[ADMIN_HIST];
+	uint64_t admin_cmds;
+	uint64_t admin_errs;
+	uint64_t admin_ns;	/* total */
+	uint64_t admin_max_ns;
+	bool hung;		/* a command was abandoned, see admin_call */
+	unsigned int inflight;	/* admitted admin commands, see admin_admit */
+};
+
+static int ioctl_open(struct lsnvme_handle *h, const char *devnode)
+{
+	h->fd = open(devnode, O_RDONLY|O_CLOEXEC);
+	if (h->fd < 0) {
+		perror(devnode);
+		return errno;
+	}
+
+	return 0;
+}
+
+static void ioctl_close(struct lsnvme_handle *h)
+{
+	close(h->fd);
+}
+
+static int ioctl_admin(struct lsnvme_handle *h, struct nvme_admin_cmd *cmd)
+{
+	int ret = ioctl(h->fd, NVME_IOCTL_ADMIN_CMD, cmd);
+
+	return ret < 0 ? errno : ret;
+}
+
+static int ioctl_io(struct lsnvme_handle *h, struct nvme_user_io *io)
+{
+	int ret = ioctl(h->fd, NVME_IOCTL_SUBMIT_IO, io);
+
+	return ret < 0 ? errno : ret;
+}
+
+static const struct lsnvme_transport ioctl_transport = {
+	.name = "ioctl",
+	.open = ioctl_open,
+	.close = ioctl_close,
+	.admin = ioctl_admin,
+	.io = ioctl_io,
+};
+
+static const struct lsnvme_transport *transport = &ioctl_transport;
+
+/*
+ * The mock controller synthesizes Identify data, log pages and feature
+ * values from the controller instance. With dir=DIR, raw files in
+ * DIR/nvmeN override them: id-ctrl, id-ns-<nsid>, log-<lid in hex> and
+ * latency (microseconds added to every command of that controller).
+ */
+static struct {
+	char *dir;
+	unsigned int nr_ns;	/* namespaces per controller, 0: any NSID */
+	unsigned int latency;	/* microseconds added to every command */
+} mock = { NULL, 0, 0 };
+
+struct mock_ctrl {
+	unsigned int instance;
+	unsigned int latency;
+	int dirfd;		/* DIR/nvmeN, -1 if there is none */
+	struct timespec born;	/* SMART counters grow from here */
+};
+
+/* fill buf from DIR/nvmeN/name if the file exists */
+static bool mock_file(struct mock_ctrl *mc, const char *name, void *buf,
+		      size_t len)
+{
+	ssize_t ret;
+	size_t off = 0;
+	int fd;
+
+	if (mc->dirfd < 0)
+		return false;
+
+	fd = openat(mc->dirfd, name, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	while (off < len && (ret = read(fd, (char *)buf + off,
+					len - off)) > 0)
+		off += ret;
+	close(fd);
+
+	memset((char *)buf + off, 0, len - off);
+	return true;
+}
+
+static void mock_str(char *dst, size_t len, const char *fmt, unsigned int n)
+{
+	char tmp[64];
+	size_t l;
+
+	l = snprintf(tmp, sizeof(tmp), fmt, n);
+	memset(dst, ' ', len);
+	memcpy(dst, tmp, l < len ? l : len);
+}
+
+static void mock_le128(__u8 *dst, uint64_t v)
+{
+	v = htole64(v);
+	memcpy(dst, &v, sizeof(v));
+}
+
+static void mock_id_ctrl(struct mock_ctrl *mc, struct nvme_id_ctrl *id)
+{
+	memset(id, 0, sizeof(*id));
+
+	id->vid = htole16(0x1b36);
+	id->ssvid = htole16(0x1af4);
+	mock_str(id->sn, sizeof(id->sn), "MOCK%08u", mc->instance);
+	mock_str(id->mn, sizeof(id->mn), "lsnvme mock controller", 0);
+	mock_str(id->fr, sizeof(id->fr), "1.0", 0);
+	id->mdts = 5;
+	id->cntlid = htole16(mc->instance);
+	id->ver = htole32(NVME_VS(1, 4));
+	id->frmw = 2 << 1 | 1;		/* two slots, slot 1 read only */
+	id->lpa = 1 << 1;
+	id->elpe = 63;
+	id->npss = 2;
+	id->apsta = 1;
+	id->sqes = 0x66;
+	id->cqes = 0x44;
+	id->nn = htole32(mock.nr_ns);
+	mock_le128(id->tnvmcap, (uint64_t)mock.nr_ns << 30);
+
+	id->psd[0].max_power = htole16(900);
+	id->psd[1].max_power = htole16(600);
+	id->psd[1].entry_lat = htole32(5);
+	id->psd[1].exit_lat = htole32(5);
+	id->psd[2].max_power = htole16(5);
+	id->psd[2].flags = NVME_PS_FLAGS_NON_OP_STATE;
+	id->psd[2].entry_lat = htole32(2000);
+	id->psd[2].exit_lat = htole32(10000);
+}
+
+static void mock_id_ns(struct nvme_id_ns *ns)
+{
+	memset(ns, 0, sizeof(*ns));
+
+	ns->nsze = ns->ncap = ns->nuse = htole64(1 << 21);
+	ns->nlbaf = 1;
+	ns->flbas = 0;
+	ns->lbaf[0].ds = 9;
+	ns->lbaf[0].rp = NVME_LBAF_RP_GOOD;
+	ns->lbaf[1].ds = 12;
+	ns->lbaf[1].rp = NVME_LBAF_RP_BEST;
+	mock_le128(ns->nvmcap, 1ULL << 30);
+}
+
+static void mock_smart(struct mock_ctrl *mc, struct nvme_smart_log *smart)
+{
+	struct timespec t;
+	uint64_t ms, ios;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	ms = (t.tv_sec - mc->born.tv_sec) * 1000 +
+	     (t.tv_nsec - mc->born.tv_nsec) / 1000000;
+	ios = ms * 10 * (mc->instance + 1);
+
+	memset(smart, 0, sizeof(*smart));
+	smart->temperature[0] = 313 & 0xff;
+	smart->temperature[1] = 313 >> 8;
+	smart->avail_spare = 100;
+	smart->spare_thresh = 10;
+	mock_le128(smart->host_reads, ios);
+	mock_le128(smart->host_writes, ios / 2);
+	mock_le128(smart->data_units_read, ios / 8);
+	mock_le128(smart->data_units_written, ios / 16);
+	mock_le128(smart->power_cycles, 10);
+	mock_le128(smart->power_on_hours, 1000 + mc->instance);
+}
+
+static int mock_identify(struct mock_ctrl *mc, struct nvme_admin_cmd *cmd,
+			 void *buf)
+{
+	char name[32];
+	__le32 *list = buf;
+	unsigned int i, n = 0;
+
+	switch (cmd->cdw10 & 0xff) {
+	case 0:
+		if (cmd->nsid < 1 || (mock.nr_ns && cmd->nsid > mock.nr_ns))
+			return NVME_SC_INVALID_NS | NVME_SC_DNR;
+		snprintf(name, sizeof(name), "id-ns-%u", cmd->nsid);
+		if (!mock_file(mc, name, buf, 4096))
+			mock_id_ns(buf);
+		return 0;
+	case 1:
+		if (!mock_file(mc, "id-ctrl", buf, 4096))
+			mock_id_ctrl(mc, buf);
+		return 0;
+	case 2:
+		memset(buf, 0, 4096);
+		for (i = cmd->nsid + 1; i <= mock.nr_ns && n < 1024; ++i)
+			list[n++] = htole32(i);
+		return 0;
+	}
+
+	return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+}
+
+static int mock_get_log(struct mock_ctrl *mc, struct nvme_admin_cmd *cmd,
+			void *buf, size_t len)
+{
+	struct nvme_firmware_log_page *fw = buf;
+	struct nvme_error_log_page *err = buf;
+	uint8_t lid = cmd->cdw10 & 0xff;
+	unsigned int i;
+	char name[32];
+
+	snprintf(name, sizeof(name), "log-%02x", lid);
+	if (mock_file(mc, name, buf, len))
+		return 0;
+
+	memset(buf, 0, len);
+
+	switch (lid) {
+	case NVME_LOG_ERROR:
+		/* controller N has logged N errors */
+		for (i = 0; i < mc->instance && (i + 1) * sizeof(*err) <= len;
+		     ++i) {
+			err[i].error_count = htole64(mc->instance - i);
+			err[i].sqid = htole16(1);
+			err[i].cmdid = htole16(mc->instance - i);
+			err[i].status_field = htole16(NVME_SC_INVALID_FIELD << 1);
+			err[i].parm_error_location = htole16(0xffff);
+			err[i].nsid = htole32(1);
+		}
+		return 0;
+	case NVME_LOG_SMART:
+		mock_smart(mc, buf);
+		return 0;
+	case NVME_LOG_FW_SLOT:
+		fw->afi = 1;
+		memcpy(&fw->frs[0], "1.0     ", 8);
+		/* odd controllers have an update staged for the next reset */
+		if (mc->instance & 1) {
+			fw->afi |= 2 << 4;
+			memcpy(&fw->frs[1], "1.1     ", 8);
+		}
+		return 0;
+	}
+
+	return NVME_SC_INVALID_LOG_PAGE | NVME_SC_DNR;
+}
+
+static int mock_get_features(struct mock_ctrl *mc, struct nvme_admin_cmd *cmd,
+			     void *buf)
+{
+	struct nvme_auto_pst *apst = buf;
+
+	switch (cmd->cdw10 & 0xff) {
+	case NVME_FEAT_AUTO_PST:
+		/* even controllers drop to the non-operational ps2 */
+		cmd->result = !(mc->instance & 1);
+		apst[0].data = htole32(100 << 8 | 2 << 3);
+		apst[1].data = htole32(100 << 8 | 2 << 3);
+		break;
+	}
+
+	return 0;
+}
+
+static int mock_open(struct lsnvme_handle *h, const char *devnode)
+{
+	const char *name = strrchr(devnode, '/');
+	struct mock_ctrl *mc;
+	char buf[16];
+
+	name = name ? name + 1 : devnode;
+
+	mc = calloc(1, sizeof(*mc));
+	if (!mc)
+		return ENOMEM;
+
+	if (sscanf(name, "nvme%u", &mc->instance) != 1)
+		mc->instance = minor(h->devnum);
+	mc->latency = mock.latency;
+	mc->dirfd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &mc->born);
+
+	if (mock.dir) {
+		snprintf(buf, sizeof(buf), "nvme%u", mc->instance);
+		mc->dirfd = openat(AT_FDCWD, mock.dir, O_RDONLY|O_DIRECTORY|
+				   O_CLOEXEC);
+		if (mc->dirfd >= 0) {
+			int fd = openat(mc->dirfd, buf, O_RDONLY|O_DIRECTORY|
+					O_CLOEXEC);
+
+			close(mc->dirfd);
+			mc->dirfd = fd;
+		}
+		if (mock_file(mc, "latency", buf, sizeof(buf) - 1))
+			mc->latency = strtoul(buf, NULL, 10);
+	}
+
+	h->priv = mc;
+	return 0;
+}
+
+static void mock_close(struct lsnvme_handle *h)
+{
+	struct mock_ctrl *mc = h->priv;
+
+	if (mc->dirfd >= 0)
+		close(mc->dirfd);
+	free(mc);
+}
+
+static void mock_delay(struct mock_ctrl *mc)
+{
+	struct timespec t = {
+		.tv_sec = mc->latency / 1000000,
+		.tv_nsec = mc->latency % 1000000 * 1000,
+	};
+
+	while (mc->latency && nanosleep(&t, &t) && errno == EINTR)
+		;
+}
+
+static int mock_admin(struct lsnvme_handle *h, struct nvme_admin_cmd *cmd)
+{
+	struct mock_ctrl *mc = h->priv;
+	void *buf = (void *)(uintptr_t)cmd->addr;
+	size_t len = cmd->data_len > 4096 ? cmd->data_len : 4096;
+	unsigned char *page;
+	int ret;
+
+	mock_delay(mc);
+
+	if (cmd->data_len > 1 << 20)
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+
+	page = calloc(1, len);
+	if (!page)
+		return ENOMEM;
+
+	cmd->result = 0;
+	switch (cmd->opcode) {
+	case nvme_admin_identify:
+		ret = mock_identify(mc, cmd, page);
+		break;
+	case nvme_admin_get_log_page:
+		ret = mock_get_log(mc, cmd, page, len);
+		break;
+	case nvme_admin_get_features:
+		ret = mock_get_features(mc, cmd, page);
+		break;
+	default:
+		ret = NVME_SC_INVALID_OPCODE | NVME_SC_DNR;
+		break;
+	}
+
+	if (!ret && buf)
+		memcpy(buf, page, cmd->data_len);
+	free(page);
+
+	return ret;
+}
+
+static int mock_io(struct lsnvme_handle *h, struct nvme_user_io *io)
+{
+	mock_delay(h->priv);
+
+	return io->opcode == nvme_cmd_read ? 0 :
+		NVME_SC_INVALID_OPCODE | NVME_SC_DNR;
+}
+
+static const struct lsnvme_transport mock_transport = {
+	.name = "mock",
+	.open = mock_open,
+	.close = mock_close,
+	.admin = mock_admin,
+	.io = mock_io,
+};
+
+/* --mock=dir=DIR,ns=N,latency=USECS */
+static int mock_parse(char *spec)
+{
+	enum { MOCK_DIR, MOCK_NS, MOCK_LATENCY };
+	char *const tokens[] = {
+		[MOCK_DIR] = "dir",
+		[MOCK_NS] = "ns",
+		[MOCK_LATENCY] = "latency",
+		NULL
+	};
+	char *value;
+
+	while (spec && *spec) {
+		switch (getsubopt(&spec, tokens, &value)) {
+		case MOCK_DIR:
+			if (!value)
+				return -1;
+			mock.dir = value;
+			break;
+		case MOCK_NS:
+			if (!value)
+				return -1;
+			mock.nr_ns = strtoul(value, NULL, 0);
+			break;
+		case MOCK_LATENCY:
+			if (!value)
+				return -1;
+			mock.latency = strtoul(value, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	transport = &mock_transport;
+	return 0;
+}
+
+/*
+ * Every controller character device is opened once, keyed by devnum, and
+ * the fd is shared by all admin commands sent to that controller and the
+ * namespaces below it. Handles live until lsnvme_dev_close_all() at exit.
+ */
+static struct lsnvme_handle **handles;
+static unsigned int nr_handles;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct lsnvme_handle *lsnvme_dev_get(dev_t devnum, const char *devnode)
+{
+	struct lsnvme_handle *h = NULL, **tmp;
+	unsigned int i;
+
+	pthread_mutex_lock(&handles_lock);
+
+	for (i = 0; i < nr_handles; ++i)
+		if (handles[i]->devnum == devnum) {
+			h = handles[i];
+			goto out;
+		}
+
+	tmp = array_grow(handles, nr_handles, sizeof(*handles));
+	if (!tmp)
+		goto out;
+	handles = tmp;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		goto out;
+
+	h->devnum = devnum;
+	h->fd = -1;
+	h->err = devnode ? transport->open(h, devnode) : ENODEV;
+	handles[nr_handles++] = h;
+out:
+	pthread_mutex_unlock(&handles_lock);
+	return h;
+}
+
+static void lsnvme_dev_free(struct lsnvme_handle *h)
+{
+	/* an abandoned command may still be using it */
+	if (__atomic_load_n(&h->hung, __ATOMIC_ACQUIRE))
+		return;
+
+	if (!h->err)
+		transport->close(h);
+	free(h);
+}
+
+/* forget a controller that went away; a new one may reuse the devnum */
+static void lsnvme_dev_drop(dev_t devnum)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&handles_lock);
+
+	for (i = 0; i < nr_handles; ++i)
+		if (handles[i]->devnum == devnum) {
+			lsnvme_dev_free(handles[i]);
+			handles[i] = handles[--nr_handles];
+			break;
+		}
+
+	pthread_mutex_unlock(&handles_lock);
+}
+
+static void lsnvme_dev_close_all(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_handles; ++i)
+		lsnvme_dev_free(handles[i]);
+
+	free(handles);
+	handles = NULL;
+	nr_handles = 0;
+}
+
+static struct lsnvme_handle *lsnvme_dev_find(dev_t devnum)
+{
+	struct lsnvme_handle *h = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&handles_lock);
+	for (i = 0; i < nr_handles; ++i)
+		if (handles[i]->devnum == devnum) {
+			h = handles[i];
+			break;
+		}
+	pthread_mutex_unlock(&handles_lock);
+
+	return h;
+}
+
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* several threads may share a handle, so only atomics here */
+static void lsnvme_admin_account(struct lsnvme_handle *h, uint64_t ns,
+				 int ret)
+{
+	uint64_t us = ns / 1000, max;
+	unsigned int b = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (b >= ADMIN_HIST)
+		b = ADMIN_HIST - 1;
+
+	__atomic_fetch_add(&h->admin_hist[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->admin_cmds, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->admin_ns, ns, __ATOMIC_RELAXED);
+	if (ret)
+		__atomic_fetch_add(&h->admin_errs, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&h->admin_max_ns, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&h->admin_max_ns, &max, ns, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Deadlines (--timeout, --deadline): the command runs on a helper thread
+ * while the caller waits at most until the earlier of the per-command and
+ * the global deadline. The budget is deliberately not handed to the driver
+ * as timeout_ms: an expired admin command makes the PCIe driver reset the
+ * controller, so the ioctl keeps the driver's own admin timeout and only
+ * user space gives up early. A command that misses it is abandoned: the
+ * helper owns a copy of the command and its buffer and frees them when
+ * the ioctl finally returns, the caller gets ETIMEDOUT, and the controller
+ * is marked hung so nothing else queues up behind the stuck command. The
+ * host-wide admission slot is given back right away, the controller's own
+ * slot stays taken until the ioctl returns and the helper releases it;
+ * nothing else is sent to a hung controller anyway.
+ */
+static uint64_t deadline_ns;		/* global, 0: none */
+static unsigned int abandoned;		/* helpers still out there */
+static pthread_mutex_t call_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t call_cond;
+static pthread_once_t call_once = PTHREAD_ONCE_INIT;
+
+struct admin_call {
+	struct lsnvme_handle *h;
+	struct nvme_admin_cmd cmd;
+	void *buf;
+	int ret;
+	bool done;
+	bool release;		/* abandoned holding an admission slot */
+	int refs;		/* caller and helper */
+};
+
+static void admin_call_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&call_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static void admin_call_put(struct admin_call *c)
+{
+	if (--c->refs)
+		return;
+	free(c->buf);
+	free(c);
+}
+
+static void admin_release_ctrl(struct lsnvme_handle *h);
+
+static void *admin_call_fn(void *arg)
+{
+	struct admin_call *c = arg;
+	struct lsnvme_handle *h = c->h;
+	int ret = transport->admin(h, &c->cmd);
+	bool release;
+
+	pthread_mutex_lock(&call_lock);
+	c->ret = ret;
+	c->done = true;
+	release = c->release;
+	admin_call_put(c);
+	pthread_cond_broadcast(&call_cond);
+	pthread_mutex_unlock(&call_lock);
+
+	if (release)
+		admin_release_ctrl(h);
+
+	return NULL;
+}
+
+/*
+ * *held says whether the caller holds admission slots for the command; it
+ * is cleared when an abandoned command takes the controller slot with it.
+ */
+static int lsnvme_admin_bounded(struct lsnvme_handle *h,
+				struct nvme_admin_cmd *cmd, bool *held)
+{
+	uint64_t t = mono_ns(), end = deadline_ns;
+	struct admin_call *c;
+	struct timespec ts;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	if (opts.timeout_ms && (!end || t + opts.timeout_ms * 1000000ULL < end))
+		end = t + opts.timeout_ms * 1000000ULL;
+	if (t >= end || __atomic_load_n(&h->hung, __ATOMIC_ACQUIRE))
+		return ETIMEDOUT;
+
+	pthread_once(&call_once, admin_call_init);
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return ENOMEM;
+	c->h = h;
+	c->cmd = *cmd;
+	c->refs = 2;
+	if (cmd->data_len) {
+		c->buf = malloc(cmd->data_len);
+		if (!c->buf) {
+			free(c);
+			return ENOMEM;
+		}
+		memcpy(c->buf, (void *)(uintptr_t)cmd->addr, cmd->data_len);
+		c->cmd.addr = (uint64_t)(uintptr_t)c->buf;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, admin_call_fn, c)) {
+		/* no helper, run it here without a deadline */
+		pthread_attr_destroy(&attr);
+		admin_call_fn(c);
+	} else {
+		pthread_attr_destroy(&attr);
+	}
+
+	ts.tv_sec = end / 1000000000ULL;
+	ts.tv_nsec = end % 1000000000ULL;
+
+	pthread_mutex_lock(&call_lock);
+	while (!c->done &&
+	       pthread_cond_timedwait(&call_cond, &call_lock, &ts) != ETIMEDOUT)
+		;
+
+	if (c->done) {
+		ret = c->ret;
+		cmd->result = c->cmd.result;
+		if (cmd->data_len)
+			memcpy((void *)(uintptr_t)cmd->addr, c->buf,
+			       cmd->data_len);
+	} else {
+		ret = ETIMEDOUT;
+		__atomic_store_n(&h->hung, true, __ATOMIC_RELEASE);
+		++abandoned;
+		c->release = *held;
+		*held = false;
+	}
+	admin_call_put(c);
+	pthread_mutex_unlock(&call_lock);
+
+	return ret;
+}
+
+/*
+ * Admission control: before an admin command is sent it has to fit under
+ * the per-controller (--max-inflight) and host-wide (--max-host-inflight)
+ * in-flight limits and take a token from a host-wide bucket refilled at
+ * --rate commands per second. Waiting never extends past the global
+ * deadline.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int inflight;	/* host wide */
+	double tokens;
+	uint64_t last_ns;	/* of the last refill */
+} adm = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static pthread_once_t adm_once = PTHREAD_ONCE_INIT;
+
+static void admin_admit_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&adm.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	adm.tokens = opts.burst;
+	adm.last_ns = mono_ns();
+}
+
+static bool admin_limited(void)
+{
+	return opts.ctrl_inflight || opts.host_inflight || opts.rate > 0;
+}
+
+/*
+ * 0 once the command may go, ETIMEDOUT if the global deadline or the
+ * command's own --timeout passed first, or the controller hung meanwhile
+ */
+static int admin_admit(struct lsnvme_handle *h)
+{
+	uint64_t t, until, end = deadline_ns;
+	struct timespec ts;
+	int ret = 0;
+
+	t = mono_ns();
+	if (opts.timeout_ms && (!end || t + opts.timeout_ms * 1000000ULL < end))
+		end = t + opts.timeout_ms * 1000000ULL;
+
+	pthread_once(&adm_once, admin_admit_init);
+	pthread_mutex_lock(&adm.lock);
+
+	for (;;) {
+		t = mono_ns();
+		if ((end && t >= end) ||
+		    __atomic_load_n(&h->hung, __ATOMIC_ACQUIRE)) {
+			ret = ETIMEDOUT;
+			break;
+		}
+
+		until = end;
+		if ((opts.ctrl_inflight && h->inflight >= opts.ctrl_inflight) ||
+		    (opts.host_inflight && adm.inflight >= opts.host_inflight)) {
+			/* woken up by admin_release() */
+		} else if (opts.rate > 0) {
+			adm.tokens += (t - adm.last_ns) / 1e9 * opts.rate;
+			if (adm.tokens > opts.burst)
+				adm.tokens = opts.burst;
+			adm.last_ns = t;
+			if (adm.tokens >= 1) {
+				adm.tokens -= 1;
+				break;
+			}
+			t += (uint64_t)((1 - adm.tokens) / opts.rate * 1e9) + 1;
+			if (!until || t < until)
+				until = t;
+		} else {
+			break;
+		}
+
+		if (until) {
+			ts.tv_sec = until / 1000000000ULL;
+			ts.tv_nsec = until % 1000000000ULL;
+			pthread_cond_timedwait(&adm.cond, &adm.lock, &ts);
+		} else {
+			pthread_cond_wait(&adm.cond, &adm.lock);
+		}
+	}
+
+	if (!ret) {
+		++h->inflight;
+		++adm.inflight;
+	}
+	pthread_mutex_unlock(&adm.lock);
+
+	return ret;
+}
+
+static void admin_release_slots(struct lsnvme_handle *h, bool host)
+{
+	pthread_mutex_lock(&adm.lock);
+	if (h)
+		--h->inflight;
+	if (host)
+		--adm.inflight;
+	pthread_cond_broadcast(&adm.cond);
+	pthread_mutex_unlock(&adm.lock);
+}
+
+static void admin_release(struct lsnvme_handle *h)
+{
+	admin_release_slots(h, true);
+}
+
+static void admin_release_ctrl(struct lsnvme_handle *h)
+{
+	admin_release_slots(h, false);
+}
+
+/* returns 0, the NVMe status of the command, or a positive errno */
+static int lsnvme_admin(struct lsnvme_handle *h, struct nvme_admin_cmd *cmd)
+{
+	bool held = false;
+	uint64_t t;
+	int ret;
+
+	if (!h)
+		return ENOMEM;
+	if (h->err)
+		return h->err;
+	/* don't take a slot another controller could use */
+	if (__atomic_load_n(&h->hung, __ATOMIC_ACQUIRE))
+		return ETIMEDOUT;
+
+	if (admin_limited()) {
+		ret = admin_admit(h);
+		if (ret)
+			return ret;
+		held = true;
+	}
+
+	t = mono_ns();
+	if (opts.timeout_ms || deadline_ns)
+		ret = lsnvme_admin_bounded(h, cmd, &held);
+	else
+		ret = transport->admin(h, cmd);
+	lsnvme_admin_account(h, mono_ns() - t, ret);
+
+	if (held)
+		admin_release(h);
+	else if (admin_limited())
+		admin_release_slots(NULL, true);	/* abandoned */
+
+	return ret;
+}
+
+static int lsnvme_io(struct lsnvme_handle *h, struct nvme_user_io *io)
+{
+	if (!h)
+		return ENOMEM;
+	if (h->err)
+		return h->err;
+
+	return transport->io(h, io);
+}
+
+static int lsnvme_identify_ns(struct lsnvme_handle *h, uint32_t nsid,
+			      struct nvme_id_ns *ptr)
+{
+	struct nvme_admin_cmd cmd = {
+		.opcode = nvme_admin_identify,
+		.nsid = nsid,
+		.addr = (uint64_t) ptr,
+		.data_len = 4096,
+		.cdw10 = 0,
+	};
+
+	return lsnvme_admin(h, &cmd);
+}
+
+static struct udev_hwdb *hwdb;
+
+/* value owned by hwdb, only valid until the next lookup */
+static const char *lsnvme_hwdb_lookup(const char *modalias, const char *key)
+{
+	struct udev_list_entry *list, *current;
+
+	if (!modalias)
+		return NULL;
+
+	if (hwdb == NULL)
+		hwdb = udev_hwdb_new(udev);
+	if (hwdb == NULL)
+		return NULL;
+
+	list = udev_hwdb_get_properties_list_entry(hwdb, modalias, 0);
+	current = udev_list_entry_get_by_name(list, key);
+
+	return udev_list_entry_get_value(current);
+}
+
+static const char *lsnvme_query_hwdb(struct udev_device *dev,
+			       const char *key)
+{
+	const char *value = NULL;
+	const char *modalias = NULL;
+
+	// check if value is cached in dev object
+	value = udev_device_get_property_value(dev, key);
+	if (value)
+		return intern(value);
+
+	modalias = udev_device_get_property_value(dev, "MODALIAS");
+
+	if (!modalias)
+		return "-";
+
+	return intern_or_dash(lsnvme_hwdb_lookup(modalias, key));
+}
+
+/* CNS 02h: up to 1024 active NSIDs greater than nsid, zero terminated */
+static int lsnvme_identify_ns_list(struct lsnvme_handle *h, uint32_t nsid,
+				   __le32 *list)
+{
+	struct nvme_admin_cmd cmd = {
+		.opcode = nvme_admin_identify,
+		.nsid = nsid,
+		.addr = (uint64_t) list,
+		.data_len = 4096,
+		.cdw10 = 2,
+	};
+
+	return lsnvme_admin(h, &cmd);
+}
+
+static int lsnvme_identify_ctrl(struct lsnvme_handle *h,
+				struct nvme_id_ctrl *ptr)
+{
+	struct nvme_admin_cmd cmd = {
+		.opcode = nvme_admin_identify,
+		.addr = (uint64_t) ptr,
+		.data_len = 4096,
+		.cdw10 = 1,
+	};
+
+	return lsnvme_admin(h, &cmd);
+}
+
+/* Get Log Page; len must be a multiple of 4 */
+static int lsnvme_get_log(struct lsnvme_handle *h, uint32_t nsid, uint8_t lid,
+			  void *ptr, uint32_t len)
+{
+	uint32_t numd = (len >> 2) - 1;
+	struct nvme_admin_cmd cmd = {
+		.opcode = nvme_admin_get_log_page,
+		.nsid = nsid,
+		.addr = (uint64_t) ptr,
+		.data_len = len,
+		.cdw10 = lid | (numd & 0xffff) << 16,
+		.cdw11 = numd >> 16,
+	};
+
+	return lsnvme_admin(h, &cmd);
+}
+
+static int lsnvme_get_features(struct lsnvme_handle *h, uint8_t fid,
+			       uint32_t nsid, void *ptr, uint32_t len,
+			       uint32_t *result)
+{
+	struct nvme_admin_cmd cmd = {
+		.opcode = nvme_admin_get_features,
+		.nsid = nsid,
+		.addr = (uint64_t) ptr,
+		.data_len = len,
+		.cdw10 = fid,
+	};
+	int ret;
+
+	ret = lsnvme_admin(h, &cmd);
+	if (!ret && result)
+		*result = cmd.result;
+
+	return ret;
+}
+
+void lsnvme_printctrl_id(struct nvme_id_ctrl *id)
+{
+	printf("%sPCI Vendor ID: %x\n", TAB, id->vid);
+	printf("%sPCI Subsystem Vendor ID: %x\n", TAB, id->ssvid);
+	printf("%sSerial Number: %.20s\n", TAB, id->sn);
+	printf("%sModel Number: %.20s\n", TAB, id->mn);
+	printf("%sFirmware Revision: %.20s\n", TAB, id->fr);
+
+	printf("%sIEEE OUI Identifier: %02x%02x%02x\n",
+		TAB, id->ieee[2], id->ieee[1], id->ieee[0]);
+
+	printf("%sController ID: %x\n", TAB, id->cntlid);
+	printf("%sVersion: %x\n", TAB, id->ver);
+	printf("%sNumber of Namespaces: %d\n", TAB, id->nn);
+}
+
+/* low 64 bits of a 128-bit little endian Identify/log field */
+static uint64_t le128_lo(const __u8 *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static long double le128(const __u8 *p)
+{
+	return le128_lo(p + 8) * 18446744073709551616.0L + le128_lo(p);
+}
+
+void lsnvme_printctrl_ns(struct nvme_id_ns *ns)
+{
+	printf("%sNamespace Size: %"PRIu64"\n",
+		TAB, (uint64_t)le64toh(ns->nsze));
+	printf("%sNamespace Capacity: %"PRIu64"\n",
+		TAB, (uint64_t)le64toh(ns->ncap));
+	printf("%sNamespace Utilization: %"PRIu64"\n",
+		TAB, (uint64_t)le64toh(ns->nuse));
+	printf("%sNVM Capacity: %"PRIu64"\n",
+		TAB, le128_lo(ns->nvmcap));
+}
+	
+/*
+ * Raw Identify pages are cached below opts.cache_dir, one file per
+ * controller (NSID 0) or namespace, named after the serial number,
+ * controller ID, firmware revision and NSID. An entry is only used while
+ * the kernel uevent sequence number is the one it was written under, so a
+ * hotplug, rescan, reset or format anywhere on the host invalidates it.
+ */
+#define CACHE_MAGIC	"LSNVMEID"
+#define CACHE_VERSION	1
+
+struct cache_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	len;
+	uint64_t	seqnum;
+};
+
+static uint64_t uevent_seqnum;
+
+static void cache_init(void)
+{
+	char path[PATH_MAX], buf[32], *val;
+
+	snprintf(path, sizeof(path), "%s/kernel/uevent_seqnum", SYS);
+	val = sysfs_read(AT_FDCWD, path, buf, sizeof(buf));
+	if (!val) {
+		/* without a sequence number nothing could be validated */
+		opts.cache_dir = NULL;
+		return;
+	}
+
+	uevent_seqnum = strtoull(val, NULL, 10);
+}
+
+/* append s to buf, keeping only characters safe in a file name */
+static size_t cache_key(char *buf, size_t off, size_t len, const char *s)
+{
+	size_t end = strlen(s);
+
+	/* serial numbers and revisions are space padded */
+	while (end > 0 && s[end - 1] == ' ')
+		--end;
+
+	for (size_t i = 0; i < end && off + 1 < len; ++i)
+		buf[off++] = isalnum((unsigned char)s[i]) || s[i] == '.' ||
+			     s[i] == '-' ? s[i] : '_';
+	buf[off] = 0;
+
+	return off;
+}
+
+/*
+ * The serial number is shared by every controller of a subsystem, so the
+ * controller ID is part of the key. Controllers without either are not
+ * cached: "-" is what a missing attribute reads as.
+ */
+static bool cache_ctrl_known(const char *sn, const char *cntlid)
+{
+	return sn && *sn && strcmp(sn, "-") != 0 &&
+	       cntlid && isdigit((unsigned char)*cntlid);
+}
+
+static bool cache_path(char *buf, size_t len, const char *sn,
+		       const char *cntlid, const char *fr, uint32_t nsid)
+{
+	int off;
+
+	if (!opts.cache_dir || !cache_ctrl_known(sn, cntlid) || !fr)
+		return false;
+
+	off = snprintf(buf, len, "%s/", opts.cache_dir);
+	if (off < 0 || (size_t)off >= len)
+		return false;
+
+	off = cache_key(buf, off, len, sn);
+	off += snprintf(buf + off, len - off, "-");
+	off = cache_key(buf, off, len, cntlid);
+	off += snprintf(buf + off, len - off, "-");
+	off = cache_key(buf, off, len, fr);
+
+	return (size_t)snprintf(buf + off, len - off, "-%u", nsid) < len - off;
+}
+
+/* a private temporary next to path, for write and rename */
+static int cache_tmp(char *tmp, size_t len, const char *path)
+{
+	int fd;
+
+	if ((size_t)snprintf(tmp, len, "%s.XXXXXX", path) >= len)
+		return -1;
+
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd >= 0 && fchmod(fd, 0644) < 0) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool cache_load(const char *sn, const char *cntlid, const char *fr,
+		       uint32_t nsid, void *page, size_t len)
+{
+	char path[PATH_MAX];
+	struct cache_hdr hdr;
+	bool hit;
+	int fd;
+
+	if (opts.refresh ||
+	    !cache_path(path, sizeof(path), sn, cntlid, fr, nsid))
+		return false;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	hit = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+	      memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) == 0 &&
+	      hdr.version == CACHE_VERSION && hdr.len == len &&
+	      hdr.seqnum == uevent_seqnum &&
+	      read(fd, page, len) == (ssize_t)len;
+
+	close(fd);
+	return hit;
+}
+
+static void cache_store(const char *sn, const char *cntlid, const char *fr,
+			uint32_t nsid, const void *page, size_t len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	struct cache_hdr hdr = {
+		.magic = CACHE_MAGIC,
+		.version = CACHE_VERSION,
+		.len = len,
+		.seqnum = uevent_seqnum,
+	};
+	bool ok;
+	int fd;
+
+	if (!cache_path(path, sizeof(path), sn, cntlid, fr, nsid))
+		return;
+
+	if (mkdir(opts.cache_dir, 0755) < 0 && errno != EEXIST)
+		return;
+
+	/* write and rename so readers never see a torn entry */
+	fd = cache_tmp(tmp, sizeof(tmp), path);
+	if (fd < 0)
+		return;
+
+	ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+	     write(fd, page, len) == (ssize_t)len;
+	close(fd);
+
+	if (!ok || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+/*
+ * Identify the controller and every namespace below it. Runs on a worker
+ * thread, so only the pre-resolved device nodes may be touched here.
+ */
+static void lsnvme_identify_ctrl_one(struct lsnvme_ctrl *ctrl)
+{
+	ctrl->id = malloc(sizeof(*ctrl->id));
+	if (!ctrl->id) {
+		ctrl->id_ret = ENOMEM;
+		return;
+	}
+
+	if (cache_load(ctrl->sn, ctrl->cntlid, ctrl->fr, 0,
+		       ctrl->id, sizeof(*ctrl->id))) {
+		ctrl->id_ret = 0;
+		return;
+	}
+
+	ctrl->id_ret = lsnvme_identify_ctrl(
+		lsnvme_dev_get(ctrl->devnum, ctrl->devnode), ctrl->id);
+	if (!ctrl->id_ret)
+		cache_store(ctrl->sn, ctrl->cntlid, ctrl->fr, 0,
+			    ctrl->id, sizeof(*ctrl->id));
+}
+
+static void lsnvme_identify_ns_one(struct lsnvme_ns *ns)
+{
+	ns->id = malloc(sizeof(*ns->id));
+	if (!ns->id) {
+		ns->id_ret = ENOMEM;
+		return;
+	}
+
+	if (cache_load(ns->ctrl_sn, ns->ctrl_cntlid, ns->ctrl_fr,
+		       ns->nsid, ns->id, sizeof(*ns->id))) {
+		ns->id_ret = 0;
+		return;
+	}
+
+	ns->id_ret = lsnvme_identify_ns(
+		lsnvme_dev_get(ns->ctrl_devnum, ns->ctrl_devnode),
+		ns->nsid, ns->id);
+	if (!ns->id_ret)
+		cache_store(ns->ctrl_sn, ns->ctrl_cntlid, ns->ctrl_fr,
+			    ns->nsid, ns->id, sizeof(*ns->id));
+}
+
+static void lsnvme_list_active_ns(struct lsnvme_ctrl *ctrl)
+{
+	struct lsnvme_handle *h = lsnvme_dev_get(ctrl->devnum, ctrl->devnode);
+	__le32 page[1024];
+	uint32_t nsid = 0, *tmp;
+	unsigned int i;
+
+	do {
+		ctrl->list_ret = lsnvme_identify_ns_list(h, nsid, page);
+		if (ctrl->list_ret)
+			return;
+
+		for (i = 0; i < 1024 && page[i]; ++i) {
+			tmp = array_grow(ctrl->active, ctrl->nr_active,
+					 sizeof(*tmp));
+			if (!tmp) {
+				ctrl->list_ret = ENOMEM;
+				return;
+			}
+			ctrl->active = tmp;
+			nsid = le32toh(page[i]);
+			ctrl->active[ctrl->nr_active++] = nsid;
+		}
+	} while (i == 1024);
+}
+
+static int ns_cmp(const void *a, const void *b)
+{
+	const struct lsnvme_ns *x = a, *y = b;
+
+	if (x->nsid != y->nsid)
+		return x->nsid < y->nsid ? -1 : 1;
+	if (x->is_part != y->is_part)
+		return x->is_part ? 1 : -1;
+	return x->partno < y->partno ? -1 : x->partno > y->partno;
+}
+
+/*
+ * Join the active NSID list against the block devices found in sysfs:
+ * rows come out in NSID order, each namespace followed by its partitions,
+ * and active namespaces the host has no block device for get a row of
+ * their own.
+ */
+static void lsnvme_join_active_ns(struct lsnvme_ctrl *ctrl)
+{
+	struct lsnvme_ns *ns;
+	unsigned int i = 0, j = 0, nr = 0;
+
+	ns = calloc(ctrl->nr_ns + ctrl->nr_active, sizeof(*ns));
+	if (!ns)
+		return;
+
+	qsort(ctrl->ns, ctrl->nr_ns, sizeof(*ctrl->ns), ns_cmp);
+
+	while (i < ctrl->nr_ns || j < ctrl->nr_active) {
+		if (j == ctrl->nr_active ||
+		    (i < ctrl->nr_ns && ctrl->ns[i].nsid < ctrl->active[j])) {
+			ns[nr++] = ctrl->ns[i++];
+		} else if (i < ctrl->nr_ns &&
+			   ctrl->ns[i].nsid == ctrl->active[j]) {
+			while (i < ctrl->nr_ns &&
+			       ctrl->ns[i].nsid == ctrl->active[j])
+				ns[nr++] = ctrl->ns[i++];
+			++j;
+		} else {
+			ns[nr].ctrl_devnum = ctrl->devnum;
+			ns[nr].ctrl_devnode = ctrl->devnode;
+			ns[nr].ctrl_sysnum = ctrl->sysnum;
+			ns[nr].ctrl_sn = ctrl->sn;
+			ns[nr].ctrl_fr = ctrl->fr;
+			ns[nr].ctrl_cntlid = ctrl->cntlid;
+			ns[nr++].nsid = ctrl->active[j++];
+		}
+	}
+
+	free(ctrl->ns);
+	ctrl->ns = ns;
+	ctrl->nr_ns = nr;
+}
+
+static void lsnvme_identify_one(struct lsnvme_ctrl *ctrl)
+{
+	unsigned int n;
+
+	if (opts.active_ns && opts.disp_devs) {
+		lsnvme_list_active_ns(ctrl);
+		if (!ctrl->list_ret)
+			lsnvme_join_active_ns(ctrl);
+	}
+
+	if (!opts.verbose)
+		return;
+
+	if (opts.disp_ctrl)
+		lsnvme_identify_ctrl_one(ctrl);
+
+	for (n = 0; n < ctrl->nr_ns; ++n)
+		if (!ctrl->ns[n].is_part)
+			lsnvme_identify_ns_one(&ctrl->ns[n]);
+}
+
+/*
+ * Each worker takes a whole controller so at most one admin command is
+ * in flight per admin queue, while different controllers proceed in
+ * parallel.
+ */
+static void (*ctrl_fn)(struct lsnvme_ctrl *);
+static uint64_t pool_start_ns;
+
+/*
+ * --spread: controller i of n does not start before i/n of the window has
+ * passed, so a full collection trickles out instead of hitting every
+ * admin queue at once.
+ */
+static void spread_wait(unsigned int i)
+{
+	uint64_t t = pool_start_ns +
+		     (uint64_t)(opts.spread * 1e9 * i / nr_ctrls);
+	struct timespec ts;
+
+	if (deadline_ns && t > deadline_ns)
+		t = deadline_ns;
+
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+	       == EINTR)
+		;
+}
+
+static void *lsnvme_ctrl_worker(void *arg)
+{
+	unsigned int i;
+
+	(void)arg;
+
+	while ((i = __atomic_fetch_add(&next_ctrl, 1, __ATOMIC_RELAXED))
+	       < nr_ctrls) {
+		if (opts.spread > 0)
+			spread_wait(i);
+		ctrl_fn(&ctrls[i]);
+	}
+
+	return NULL;
+}
+
+/* run fn on every controller from a pool of at most opts.jobs threads */
+static void lsnvme_for_each_ctrl(void (*fn)(struct lsnvme_ctrl *))
+{
+	unsigned int i, nr_threads, started = 0;
+	pthread_t *threads;
+
+	ctrl_fn = fn;
+	next_ctrl = 0;
+	pool_start_ns = mono_ns();
+
+	nr_threads = nr_ctrls < opts.jobs ? nr_ctrls : opts.jobs;
+	threads = calloc(nr_threads ? nr_threads : 1, sizeof(*threads));
+
+	for (; threads && started + 1 < nr_threads; ++started)
+		if (pthread_create(&threads[started], NULL,
+				   lsnvme_ctrl_worker, NULL))
+			break;
+
+	/* the main thread is a worker too and picks up whatever is left */
+	lsnvme_ctrl_worker(NULL);
+
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+}
+
+/*
+ * Machine readable output: every row is turned into one record of typed
+ * fields and rendered as JSON (one object per line), CSV (with a header
+ * line whenever the set of columns changes) or shell-quoted key=value
+ * pairs. Records are formatted into one reusable buffer that is written
+ * out with a single write() per flush.
+ */
+enum {
+	OUT_STR,
+	OUT_U64,
+	OUT_DBL,
+};
+
+struct out_field {
+	const char *key;
+	int type;
+	const char *str;	/* NULL renders as null / empty */
+	int len;		/* -1: NUL terminated, else fixed width */
+	uint64_t u;
+	double d;
+};
+
+#define F_STR(k, v)	{ .key = (k), .type = OUT_STR, .str = (v), .len = -1 }
+#define F_FIX(k, v)	{ .key = (k), .type = OUT_STR, .str = (v), \
+			  .len = sizeof(v) }
+#define F_U64(k, v)	{ .key = (k), .type = OUT_U64, .u = (v) }
+#define F_DBL(k, v)	{ .key = (k), .type = OUT_DBL, .d = (v) }
+#define F_NULL(k)	{ .key = (k), .type = OUT_STR }
+
+#define OUT_BUF_SZ	(1 << 20)
+
+static struct {
+	char *buf;
+	size_t len;
+	const char *hdr[64];	/* CSV columns of the last header line */
+	unsigned int nr_hdr;
+} out;
+
+static void out_flush(void)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	while (off < out.len) {
+		ret = write(STDOUT_FILENO, out.buf + off, out.len - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		off += ret;
+	}
+
+	out.len = 0;
+}
+
+/* make sure len more bytes fit, flushing if needed */
+static char *out_reserve(size_t len)
+{
+	if (!out.buf) {
+		out.buf = malloc(OUT_BUF_SZ);
+		if (!out.buf)
+			return NULL;
+	}
+
+	if (out.len + len > OUT_BUF_SZ)
+		out_flush();
+
+	return len <= OUT_BUF_SZ ? out.buf + out.len : NULL;
+}
+
+static void out_putc(char c)
+{
+	char *p = out_reserve(1);
+
+	if (p) {
+		*p = c;
+		++out.len;
+	}
+}
+
+static void out_puts(const char *s, size_t len)
+{
+	char *p = out_reserve(len);
+
+	if (p) {
+		memcpy(p, s, len);
+		out.len += len;
+	}
+}
+
+static void out_printf(const char *fmt, ...)
+{
+	char tmp[64];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		out_puts(tmp, (size_t)n < sizeof(tmp) ? (size_t)n :
+			 sizeof(tmp) - 1);
+}
+
+/* length of a field value, fixed width Identify strings are trimmed */
+static size_t out_len(const struct out_field *f)
+{
+	size_t len;
+
+	if (f->len < 0)
+		return strlen(f->str);
+
+	len = strnlen(f->str, f->len);
+	while (len > 0 && (f->str[len - 1] == ' ' || f->str[len - 1] == 0))
+		--len;
+
+	return len;
+}
+
+/* length of the well-formed UTF-8 sequence at s, 0 if there is none */
+static size_t utf8_seq(const unsigned char *s, size_t len)
+{
+	size_t n, i;
+	uint32_t cp;
+
+	if (s[0] < 0xc2 || s[0] > 0xf4)
+		return 0;
+	n = s[0] >= 0xf0 ? 4 : s[0] >= 0xe0 ? 3 : 2;
+	if (len < n)
+		return 0;
+
+	cp = s[0] & (0x7f >> n);
+	for (i = 1; i < n; ++i) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		cp = cp << 6 | (s[i] & 0x3f);
+	}
+
+	/* overlong, surrogate or beyond U+10FFFF */
+	if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+	    (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+		return 0;
+
+	return n;
+}
+
+/* device strings are raw bytes: anything not valid UTF-8 goes as \u00XX */
+static void out_json_str(const char *s, size_t len)
+{
+	size_t n;
+
+	out_putc('"');
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = s[i];
+
+		if (c == '"' || c == '\\') {
+			out_putc('\\');
+			out_putc(c);
+		} else if (c < 0x20) {
+			out_printf("\\u%04x", c);
+		} else if (c < 0x80) {
+			out_putc(c);
+		} else if ((n = utf8_seq((const unsigned char *)s + i,
+					 len - i))) {
+			out_puts(s + i, n);
+			i += n - 1;
+		} else {
+			out_printf("\\u%04x", c);
+		}
+	}
+	out_putc('"');
+}
+
+static void out_csv_str(const char *s, size_t len)
+{
+	if (!memchr(s, ',', len) && !memchr(s, '"', len) &&
+	    !memchr(s, '\n', len) && !memchr(s, '\r', len)) {
+		out_puts(s, len);
+		return;
+	}
+
+	out_putc('"');
+	for (size_t i = 0; i < len; ++i) {
+		if (s[i] == '"')
+			out_putc('"');
+		out_putc(s[i]);
+	}
+	out_putc('"');
+}
+
+static void out_kv_str(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		if (!isalnum((unsigned char)s[i]) && !strchr("/._-:+", s[i]))
+			break;
+
+	if (len && i == len) {
+		out_puts(s, len);
+		return;
+	}
+
+	out_putc('\'');
+	for (i = 0; i < len; ++i)
+		if (s[i] == '\'')
+			out_puts("'\\''", 4);
+		else
+			out_putc(s[i]);
+	out_putc('\'');
+}
+
+static void out_value(const struct out_field *f)
+{
+	switch (f->type) {
+	case OUT_U64:
+		out_printf("%"PRIu64, f->u);
+		return;
+	case OUT_DBL:
+		out_printf("%.2f", f->d);
+		return;
+	}
+
+	/* "-" is the text output's placeholder for unknown */
+	if (!f->str || (f->str[0] == '-' && !f->str[1])) {
+		if (opts.format == FMT_JSON)
+			out_puts("null", 4);
+		return;
+	}
+
+	if (opts.format == FMT_JSON)
+		out_json_str(f->str, out_len(f));
+	else if (opts.format == FMT_CSV)
+		out_csv_str(f->str, out_len(f));
+	else
+		out_kv_str(f->str, out_len(f));
+}
+
+static void out_csv_header(const struct out_field *f, unsigned int nr)
+{
+	unsigned int i;
+
+	if (nr == out.nr_hdr) {
+		for (i = 0; i < nr; ++i)
+			if (strcmp(out.hdr[i], f[i].key))
+				break;
+		if (i == nr)
+			return;
+	}
+
+	out.nr_hdr = 0;
+	out_puts("type", 4);
+	for (i = 0; i < nr; ++i) {
+		out_putc(',');
+		out_puts(f[i].key, strlen(f[i].key));
+		if (i < sizeof(out.hdr) / sizeof(out.hdr[0]))
+			out.hdr[out.nr_hdr++] = f[i].key;
+	}
+	out_putc('\n');
+}
+
+static void out_record(const char *type, const struct out_field *f,
+		       unsigned int nr)
+{
+	unsigned int i;
+
+	switch (opts.format) {
+	case FMT_JSON:
+		out_puts("{\"type\":", 8);
+		out_json_str(type, strlen(type));
+		for (i = 0; i < nr; ++i) {
+			out_putc(',');
+			out_json_str(f[i].key, strlen(f[i].key));
+			out_putc(':');
+			out_value(&f[i]);
+		}
+		out_puts("}\n", 2);
+		break;
+	case FMT_CSV:
+		out_csv_header(f, nr);
+		out_puts(type, strlen(type));
+		for (i = 0; i < nr; ++i) {
+			out_putc(',');
+			out_value(&f[i]);
+		}
+		out_putc('\n');
+		break;
+	default:
+		out_puts("type=", 5);
+		out_puts(type, strlen(type));
+		for (i = 0; i < nr; ++i) {
+			out_putc(' ');
+			out_puts(f[i].key, strlen(f[i].key));
+			out_putc('=');
+			out_value(&f[i]);
+		}
+		out_putc('\n');
+		break;
+	}
+}
+
+static struct out_field f_num(const char *key, const char *num)
+{
+	struct out_field f = F_NULL(key);
+
+	if (num && isdigit((unsigned char)*num)) {
+		f.type = OUT_U64;
+		f.u = strtoull(num, NULL, 10);
+	}
+
+	return f;
+}
+
+static struct out_field f_size(long long sectors)
+{
+	struct out_field f = F_NULL("size");
+
+	if (sectors >= 0) {
+		f.type = OUT_U64;
+		f.u = (uint64_t)sectors << 9;
+	}
+
+	return f;
+}
+
+/* outcome of the Identify command of a row with -v */
+static const char *id_status(int ret, const void *id)
+{
+	if (ret == ETIMEDOUT)
+		return "timeout";
+	return ret || !id ? "error" : "ok";
+}
+
+static void out_ctrl(const char *action, struct lsnvme_ctrl *ctrl)
+{
+	struct nvme_id_ctrl *id = ctrl->id_ret ? NULL : ctrl->id;
+	struct out_field f[16];
+	unsigned int nr = 0;
+
+	if (action)
+		f[nr++] = (struct out_field)F_STR("action", action);
+	f[nr++] = f_num("ctrl", ctrl->sysnum);
+	f[nr++] = (struct out_field)F_STR("dev", ctrl->devnode);
+	f[nr++] = (struct out_field)F_STR("vendor", ctrl->vendor);
+	f[nr++] = (struct out_field)F_STR("model", ctrl->model);
+	f[nr++] = (struct out_field)F_STR("bus", ctrl->subsystem);
+	f[nr++] = (struct out_field)F_STR("driver", ctrl->driver);
+
+	if (opts.verbose && id) {
+		f[nr++] = (struct out_field)F_U64("vid", le16toh(id->vid));
+		f[nr++] = (struct out_field)F_U64("ssvid", le16toh(id->ssvid));
+		f[nr++] = (struct out_field)F_FIX("sn", id->sn);
+		f[nr++] = (struct out_field)F_FIX("mn", id->mn);
+		f[nr++] = (struct out_field)F_FIX("fr", id->fr);
+		f[nr++] = (struct out_field)F_U64("cntlid",
+						  le16toh(id->cntlid));
+		f[nr++] = (struct out_field)F_U64("ver", le32toh(id->ver));
+		f[nr++] = (struct out_field)F_U64("nn", le32toh(id->nn));
+	} else if (opts.verbose) {
+		static const char *keys[] = {
+			"vid", "ssvid", "sn", "mn", "fr", "cntlid", "ver", "nn",
+		};
+
+		for (unsigned int i = 0; i < 8; ++i)
+			f[nr++] = (struct out_field)F_NULL(keys[i]);
+	}
+	if (opts.verbose)
+		f[nr++] = (struct out_field)F_STR("status",
+				id_status(ctrl->id_ret, ctrl->id));
+
+	out_record("controller", f, nr);
+}
+
+/* namespaces and partitions share one set of columns */
+static void out_ns(const char *action, struct lsnvme_ns *ns)
+{
+	struct nvme_id_ns *id = ns->id_ret ? NULL : ns->id;
+	struct out_field f[16];
+	unsigned int nr = 0;
+
+	if (action)
+		f[nr++] = (struct out_field)F_STR("action", action);
+	f[nr++] = f_num("ctrl", ns->ctrl_sysnum);
+	f[nr++] = f_num("ns", ns->is_part ? ns->disk_sysnum : ns->sysnum);
+	f[nr++] = f_num("part", ns->is_part ? ns->sysnum : NULL);
+	f[nr++] = (struct out_field)F_U64("nsid", ns->nsid);
+	f[nr++] = (struct out_field)F_STR("dev", ns->devnode);
+	f[nr++] = (struct out_field)F_STR("devtype", ns->devtype);
+	f[nr++] = f_size(ns->sectors);
+	f[nr++] = (struct out_field)F_STR("vendor", ns->vendor);
+	f[nr++] = (struct out_field)F_STR("model", ns->model);
+	f[nr++] = (struct out_field)F_STR("rev", ns->rev);
+
+	if (opts.verbose && id) {
+		f[nr++] = (struct out_field)F_U64("nsze", le64toh(id->nsze));
+		f[nr++] = (struct out_field)F_U64("ncap", le64toh(id->ncap));
+		f[nr++] = (struct out_field)F_U64("nuse", le64toh(id->nuse));
+		f[nr++] = (struct out_field)F_U64("nvmcap", le128_lo(id->nvmcap));
+	} else if (opts.verbose) {
+		f[nr++] = (struct out_field)F_NULL("nsze");
+		f[nr++] = (struct out_field)F_NULL("ncap");
+		f[nr++] = (struct out_field)F_NULL("nuse");
+		f[nr++] = (struct out_field)F_NULL("nvmcap");
+	}
+	if (opts.verbose && !ns->is_part)
+		f[nr++] = (struct out_field)F_STR("status",
+				id_status(ns->id_ret, ns->id));
+	else if (opts.verbose)
+		f[nr++] = (struct out_field)F_NULL("status");
+
+	out_record(ns->is_part ? "partition" : "namespace", f, nr);
+}
+
+/*
+ * [dev:ns] device_file devtype size <vendor model revision>
+ */
+void lsnvme_printbd(struct lsnvme_ns *ns, const char *tab)
+{
+	char size[BD_SIZE_LEN];
+
+	if (opts.format != FMT_TEXT) {
+		out_ns(NULL, ns);
+		return;
+	}
+
+	if (!ns->devnode) {
+		printf("[%s:%u]\t-\t-\t-\t-\t-\t-\n",
+			ns->ctrl_sysnum, ns->nsid);
+		if (opts.verbose && !ns->id_ret && ns->id)
+			lsnvme_printctrl_ns(ns->id);
+		return;
+	}
+
+	printf("[%s:%s]\t%s\t%s\t%s\t%s\t%s\t%s%s\n",
+		ns->ctrl_sysnum,
+		ns->sysnum,
+		ns->devnode,
+		ns->devtype,
+		bd_size(ns->sectors, size),
+		ns->vendor,
+		ns->model,
+		ns->rev,
+		opts.verbose && ns->id_ret == ETIMEDOUT ? "\ttimeout" : ""
+	);
+
+	if (opts.verbose) {
+		if (ns->id_ret == ETIMEDOUT)
+			fprintf(stderr, "%scommand timed out on: %s\n",
+				TAB, ns->devnode);
+		else if (ns->id_ret || !ns->id)
+			fprintf(stderr, "%sioctl failed on: %s\n",
+				TAB, ns->devnode);
+		else
+			lsnvme_printctrl_ns(ns->id);
+	}
+}
+
+/*
+ * [dev:ns:pn] device_file devtype size (part type?)
+ */
+void lsnvme_printpart(struct lsnvme_ns *ns, const char *tab)
+{
+	char size[BD_SIZE_LEN];
+
+	if (opts.format != FMT_TEXT) {
+		out_ns(NULL, ns);
+		return;
+	}
+
+	printf("[%s:%s:%s]\t%s\t%s\t%s\n",
+		ns->ctrl_sysnum,
+		ns->disk_sysnum,
+		ns->sysnum,
+		ns->devnode,
+		ns->devtype,
+		bd_size(ns->sectors, size)
+	);
+}
+
+/*
+ * [dev] device_file vendor  model  bus  driver (transport?)
+ */
+void lsnvme_printctrl(struct lsnvme_ctrl *ctrl)
+{
+	if (opts.format != FMT_TEXT) {
+		out_ctrl(NULL, ctrl);
+		return;
+	}
+
+	printf("[%s]\t%s\t%s\t%s\t%s\t%s%s\n",
+		ctrl->sysnum,
+		ctrl->devnode,
+		ctrl->vendor,
+		ctrl->model,
+		ctrl->subsystem,
+		ctrl->driver,
+		opts.verbose && ctrl->id_ret == ETIMEDOUT ? "\ttimeout" : ""
+	);
+
+	if (opts.verbose) {
+		if (ctrl->id_ret == ETIMEDOUT)
+			fprintf(stderr, "%scommand timed out on: %s\n",
+				TAB, ctrl->devnode);
+		else if (ctrl->id_ret || !ctrl->id)
+			fprintf(stderr, "%sioctl failed on: %s\n",
+				TAB, ctrl->devnode);
+		else
+			lsnvme_printctrl_id(ctrl->id);
+	}
+}
+
+/* fill in a controller row from udev, resolving the parent chain once */
+static void lsnvme_ctrl_init(struct lsnvme_ctrl *ctrl, struct udev_device *dev)
+{
+	struct udev_device *pdev = udev_device_get_parent(dev);
+
+	memset(ctrl, 0, sizeof(*ctrl));
+	ctrl->dev = dev;
+	ctrl->sysname = intern(udev_device_get_sysname(dev));
+	ctrl->sysnum = intern(udev_device_get_sysnum(dev));
+	ctrl->devnode = intern(udev_device_get_devnode(dev));
+	ctrl->devnum = udev_device_get_devnum(dev);
+	ctrl->vendor = lsnvme_query_hwdb(pdev, "ID_VENDOR_FROM_DATABASE");
+	ctrl->model = lsnvme_query_hwdb(pdev, "ID_MODEL_FROM_DATABASE");
+	ctrl->subsystem = intern(udev_device_get_subsystem(pdev));
+	ctrl->driver = intern(find_driver(dev));
+	ctrl->mn = intern(udev_device_get_sysattr_value(dev, "model"));
+	ctrl->sn = intern(udev_device_get_sysattr_value(dev, "serial"));
+	ctrl->fr = intern(udev_device_get_sysattr_value(dev, "firmware_rev"));
+	ctrl->cntlid = intern(udev_device_get_sysattr_value(dev, "cntlid"));
+}
+
+static void lsnvme_ns_init(struct lsnvme_ns *ns, struct udev_device *dev,
+			   struct udev_device *ctrl)
+{
+	const char *dt = udev_device_get_devtype(dev);
+	struct udev_device *disk = dev;
+	const char *nsid;
+	char path[PATH_MAX], buf[32];
+
+	memset(ns, 0, sizeof(*ns));
+	ns->dev = dev;
+	ns->sysname = intern(udev_device_get_sysname(dev));
+	ns->sysnum = intern(udev_device_get_sysnum(dev));
+	ns->devnode = intern(udev_device_get_devnode(dev));
+	ns->devnum = udev_device_get_devnum(dev);
+	ns->devtype = intern(dt);
+	ns->ctrl_devnum = udev_device_get_devnum(ctrl);
+	ns->ctrl_devnode = intern(udev_device_get_devnode(ctrl));
+	ns->ctrl_sysnum = intern(udev_device_get_sysnum(ctrl));
+	ns->ctrl_sn = intern(udev_device_get_sysattr_value(ctrl, "serial"));
+	ns->ctrl_fr = intern(udev_device_get_sysattr_value(ctrl,
+							   "firmware_rev"));
+	ns->ctrl_cntlid = intern(udev_device_get_sysattr_value(ctrl,
+							       "cntlid"));
+	ns->is_part = !(dt && strcmp(dt, "partition"));
+
+	snprintf(path, sizeof(path), "%s/size", udev_device_get_syspath(dev));
+	ns->sectors = parse_sectors(sysfs_read(AT_FDCWD, path, buf,
+					       sizeof(buf)));
+
+	if (ns->is_part) {
+		ns->partno = atoi(udev_device_get_sysnum(dev));
+		disk = udev_device_get_parent(dev);
+		ns->disk_sysnum = intern(udev_device_get_sysnum(disk));
+		ns->ctrl_sysnum = intern(udev_device_get_sysnum(
+					udev_device_get_parent(disk)));
+	} else {
+		ns->vendor = lsnvme_query_hwdb(dev, "ID_VENDOR");
+		ns->model = lsnvme_query_hwdb(dev, "ID_MODEL");
+		ns->rev = lsnvme_query_hwdb(dev, "ID_REVISION");
+	}
+
+	/* the disk name carries the instance, not necessarily the NSID */
+	nsid = udev_device_get_sysattr_value(disk, "nsid");
+	if (!nsid)
+		nsid = udev_device_get_sysnum(disk);
+	ns->nsid = nsid ? strtoul(nsid, NULL, 0) : 0;
+}
+
+static int lsnvme_ls(char *path)
+{
+	struct udev_device *dev = find_device(path);
+	if (dev == NULL)
+		return EXIT_FAILURE;
+
+	if (strcmp(udev_device_get_subsystem(dev), NVME) == 0) {
+		struct lsnvme_ctrl ctrl;
+
+		lsnvme_ctrl_init(&ctrl, dev);
+		if (opts.verbose)
+			lsnvme_identify_ctrl_one(&ctrl);
+		lsnvme_printctrl(&ctrl);
+		free(ctrl.id);
+	} else {
+		struct udev_device *ctrl = udev_device_get_parent(dev);
+		struct lsnvme_ns ns;
+
+		/* namespace heads without a controller parent take the
+		 * admin commands on their own block device */
+		if (!ctrl || !udev_device_get_subsystem(ctrl) ||
+		    strcmp(udev_device_get_subsystem(ctrl), NVME))
+			ctrl = dev;
+
+		lsnvme_ns_init(&ns, dev, ctrl);
+		if (ns.is_part) {
+			lsnvme_printpart(&ns, "");
+		} else {
+			if (opts.verbose)
+				lsnvme_identify_ns_one(&ns);
+			lsnvme_printbd(&ns, "");
+		}
+		free(ns.id);
+	}
+
+	udev_device_unref(dev);
+
+	return EXIT_SUCCESS;
+}
+
+static struct lsnvme_ctrl *lsnvme_add_ctrl(void)
+{
+	struct lsnvme_ctrl *ctrl = array_grow(ctrls, nr_ctrls, sizeof(*ctrl));
+
+	if (!ctrl)
+		return NULL;
+
+	ctrls = ctrl;
+	ctrl = &ctrls[nr_ctrls++];
+	memset(ctrl, 0, sizeof(*ctrl));
+
+	return ctrl;
+}
+
+static struct lsnvme_ns *lsnvme_add_ns(struct lsnvme_ctrl *ctrl)
+{
+	struct lsnvme_ns *ns = array_grow(ctrl->ns, ctrl->nr_ns, sizeof(*ns));
+
+	if (!ns)
+		return NULL;
+
+	ctrl->ns = ns;
+	ns = &ctrl->ns[ctrl->nr_ns++];
+	memset(ns, 0, sizeof(*ns));
+
+	return ns;
+}
+
+static struct lsnvme_ctrl *lsnvme_find_ctrl(struct udev_device *dev)
+{
+	unsigned int i;
+	dev_t devnum;
+
+	if (!dev)
+		return NULL;
+
+	devnum = udev_device_get_devnum(dev);
+	for (i = 0; i < nr_ctrls; ++i)
+		if (ctrls[i].devnum == devnum)
+			return &ctrls[i];
+
+	return NULL;
+}
+
+static void lsnvme_udev_enum_ctrl(void)
+{
+	struct udev_enumerate *enum_parents;
+	struct udev_list_entry *devices, *dev_list_entry;
+	struct lsnvme_ctrl *ctrl;
+	struct udev_device *dev;
+	const char *path;
+
+	enum_parents = udev_enumerate_new(udev);
+
+	udev_enumerate_add_match_subsystem(enum_parents, NVME);
+
+	udev_enumerate_scan_devices(enum_parents);
+	devices = udev_enumerate_get_list_entry(enum_parents);
+	udev_list_entry_foreach(dev_list_entry, devices) {
+		path = udev_list_entry_get_name(dev_list_entry);
+		dev = udev_device_new_from_syspath(udev, path);
+		if (!dev)
+			continue;
+
+		ctrl = lsnvme_add_ctrl();
+		if (!ctrl) {
+			udev_device_unref(dev);
+			break;
+		}
+		lsnvme_ctrl_init(ctrl, dev);
+	}
+
+	udev_enumerate_unref(enum_parents);
+}
+
+/*
+ * One pass over the nvme block devices, each attached to the controller
+ * it hangs off (its parent, or its grandparent for partitions).
+ */
+static void lsnvme_udev_enum_devs(void)
+{
+	struct udev_enumerate *enum_children = udev_enumerate_new(udev);
+	struct udev_list_entry *devices, *dev_list_entry;
+	struct udev_device *cdev, *parent;
+	struct lsnvme_ctrl *ctrl;
+	struct lsnvme_ns *ns;
+	const char *path, *dt;
+
+	udev_enumerate_add_match_subsystem(enum_children, "block");
+	udev_enumerate_add_match_sysname(enum_children, "nvme*");
+
+	udev_enumerate_scan_devices(enum_children);
+	devices = udev_enumerate_get_list_entry(enum_children);
+
+	udev_list_entry_foreach(dev_list_entry, devices) {
+		path = udev_list_entry_get_name(dev_list_entry);
+		cdev = udev_device_new_from_syspath(udev, path);
+		if (!cdev)
+			continue;
+
+		dt = udev_device_get_devtype(cdev);
+		parent = udev_device_get_parent(cdev);
+		if (parent && !(dt && strcmp(dt, "partition")))
+			parent = udev_device_get_parent(parent);
+
+		ctrl = lsnvme_find_ctrl(parent);
+		if (!ctrl) {
+			udev_device_unref(cdev);
+			continue;
+		}
+
+		ns = lsnvme_add_ns(ctrl);
+		if (!ns) {
+			udev_device_unref(cdev);
+			break;
+		}
+		lsnvme_ns_init(ns, cdev, ctrl->dev);
+	}
+
+	udev_enumerate_unref(enum_children);
+}
+
+/*
+ * Native sysfs backend: walks <SYS>/class/nvme and <SYS>/block with
+ * getdents64 and reads the few attributes we print relative to cached
+ * directory fds, without creating a udev_device per row.
+ */
+struct linux_dirent64 {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+
+static int sysfs_class_fd = -1;
+static int sysfs_block_fd = -1;
+
+static int sysfs_open_dirs(void)
+{
+	int sys_fd;
+
+	if (sysfs_class_fd >= 0)
+		return 0;
+
+	sys_fd = open(SYS, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (sys_fd < 0) {
+		perror(SYS);
+		return -1;
+	}
+
+	sysfs_class_fd = openat(sys_fd, "class/nvme",
+				O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	sysfs_block_fd = openat(sys_fd, "block", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	close(sys_fd);
+
+	return sysfs_class_fd < 0 || sysfs_block_fd < 0 ? -1 : 0;
+}
+
+static void sysfs_close_dirs(void)
+{
+	if (sysfs_class_fd >= 0)
+		close(sysfs_class_fd);
+	if (sysfs_block_fd >= 0)
+		close(sysfs_block_fd);
+	sysfs_class_fd = sysfs_block_fd = -1;
+}
+
+/* call fn for every entry of dirfd whose name starts with prefix */
+static int sysfs_for_each(int dirfd, const char *prefix,
+			  void (*fn)(int dirfd, const char *name, void *arg),
+			  void *arg)
+{
+	char buf[16384] __attribute__((aligned(8)));
+	struct linux_dirent64 *d;
+	size_t len = strlen(prefix);
+	long n, pos;
+
+	if (lseek(dirfd, 0, SEEK_SET) < 0)
+		return -errno;
+
+	while ((n = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0)
+		for (pos = 0; pos < n; pos += d->d_reclen) {
+			d = (struct linux_dirent64 *)(buf + pos);
+			if (strncmp(d->d_name, prefix, len) == 0)
+				fn(dirfd, d->d_name, arg);
+		}
+
+	return n < 0 ? -errno : 0;
+}
+
+/* last component of the symlink name relative to dirfd */
+static char *sysfs_link_base(int dirfd, const char *name, char *buf, size_t len)
+{
+	ssize_t n = readlinkat(dirfd, name, buf, len - 1);
+	char *p;
+
+	if (n < 0)
+		return NULL;
+	buf[n] = 0;
+
+	p = strrchr(buf, '/');
+	return p ? p + 1 : buf;
+}
+
+static dev_t sysfs_devnum(int dirfd)
+{
+	char buf[32];
+	unsigned int maj, min;
+
+	if (!sysfs_read(dirfd, "dev", buf, sizeof(buf)) ||
+	    sscanf(buf, "%u:%u", &maj, &min) != 2)
+		return 0;
+
+	return makedev(maj, min);
+}
+
+static const char *sysfs_devnode(const char *name)
+{
+	char devnode[PATH_MAX];
+
+	if ((size_t)snprintf(devnode, sizeof(devnode), "%s/%s", DEV, name) >=
+	    sizeof(devnode))
+		return NULL;
+	return intern(devnode);
+}
+
+static const char *sysnum_of(const char *sysname)
+{
+	const char *p = sysname + strlen(sysname);
+
+	while (p > sysname && isdigit((unsigned char)p[-1]))
+		--p;
+	return p;
+}
+
+static void sysfs_add_ctrl(int dirfd, const char *name, void *arg)
+{
+	struct lsnvme_ctrl *ctrl;
+	char buf[PATH_MAX];
+	const char *modalias, *driver, *sysname;
+	int fd;
+
+	/* nvme-fabrics and friends share the class directory */
+	if (!isdigit((unsigned char)name[strlen(NVME)]))
+		return;
+
+	fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	sysname = intern(name);
+	ctrl = sysname ? lsnvme_add_ctrl() : NULL;
+	if (!ctrl) {
+		close(fd);
+		return;
+	}
+
+	ctrl->sysname = sysname;
+	ctrl->sysnum = sysnum_of(sysname);
+	ctrl->devnode = sysfs_devnode(name);
+	ctrl->devnum = sysfs_devnum(fd);
+
+	modalias = sysfs_read(fd, "device/modalias", buf, sizeof(buf));
+	ctrl->vendor = intern_or_dash(
+		lsnvme_hwdb_lookup(modalias, "ID_VENDOR_FROM_DATABASE"));
+	ctrl->model = intern_or_dash(
+		lsnvme_hwdb_lookup(modalias, "ID_MODEL_FROM_DATABASE"));
+
+	ctrl->subsystem = intern_or_dash(
+		sysfs_link_base(fd, "device/subsystem", buf, sizeof(buf)));
+
+	driver = sysfs_link_base(fd, "driver", buf, sizeof(buf));
+	if (!driver)
+		driver = sysfs_link_base(fd, "device/driver", buf, sizeof(buf));
+	ctrl->driver = intern(driver);
+
+	ctrl->mn = intern_or_dash(sysfs_read(fd, "model", buf, sizeof(buf)));
+	ctrl->sn = intern_or_dash(sysfs_read(fd, "serial", buf, sizeof(buf)));
+	ctrl->fr = intern_or_dash(sysfs_read(fd, "firmware_rev", buf,
+					     sizeof(buf)));
+	ctrl->cntlid = intern(sysfs_read(fd, "cntlid", buf, sizeof(buf)));
+
+	close(fd);
+}
+
+static struct lsnvme_ctrl *sysfs_find_ctrl(const char *sysname)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_ctrls; ++i)
+		if (strcmp(ctrls[i].sysname, sysname) == 0)
+			return &ctrls[i];
+
+	return NULL;
+}
+
+struct sysfs_disk {
+	struct lsnvme_ctrl *ctrl;
+	unsigned int disk;	/* index of the disk row in ctrl->ns */
+};
+
+static void sysfs_add_part(int dirfd, const char *name, void *arg)
+{
+	struct sysfs_disk *sd = arg;
+	struct lsnvme_ns *ns;
+	char buf[64];
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (!sysfs_read(fd, "partition", buf, sizeof(buf))) {
+		close(fd);
+		return;
+	}
+
+	ns = lsnvme_add_ns(sd->ctrl);
+	if (!ns) {
+		close(fd);
+		return;
+	}
+
+	/* the disk row may have moved when the array grew */
+	*ns = sd->ctrl->ns[sd->disk];
+	ns->id = NULL;
+	ns->is_part = true;
+	ns->partno = atoi(buf);
+	ns->sysname = intern(name);
+	ns->sysnum = ns->sysname ? sysnum_of(ns->sysname) : "-";
+	ns->devnode = sysfs_devnode(name);
+	ns->devnum = sysfs_devnum(fd);
+	ns->devtype = "partition";
+	ns->disk_sysnum = sd->ctrl->ns[sd->disk].sysnum;
+	ns->sectors = parse_sectors(sysfs_read(fd, "size", buf, sizeof(buf)));
+
+	close(fd);
+}
+
+static void sysfs_add_disk(int dirfd, const char *name, void *arg)
+{
+	struct lsnvme_ctrl *ctrl;
+	struct lsnvme_ns *ns;
+	struct sysfs_disk sd;
+	char buf[PATH_MAX], *parent;
+	ssize_t len;
+	int fd;
+
+	/* the controller is the directory the disk lives in */
+	len = readlinkat(dirfd, name, buf, sizeof(buf) - 1);
+	if (len < 0)
+		return;
+	buf[len] = 0;
+	parent = dirname(buf);
+	ctrl = sysfs_find_ctrl(basename(parent));
+	if (!ctrl)
+		return;
+
+	fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	ns = lsnvme_add_ns(ctrl);
+	if (!ns) {
+		close(fd);
+		return;
+	}
+
+	ns->sysname = intern(name);
+	ns->sysnum = ns->sysname ? sysnum_of(ns->sysname) : "-";
+	ns->devnode = sysfs_devnode(name);
+	ns->devnum = sysfs_devnum(fd);
+	ns->devtype = "disk";
+	ns->ctrl_devnum = ctrl->devnum;
+	ns->ctrl_devnode = ctrl->devnode;
+	ns->ctrl_sysnum = ctrl->sysnum;
+	ns->ctrl_sn = ctrl->sn;
+	ns->ctrl_fr = ctrl->fr;
+	ns->ctrl_cntlid = ctrl->cntlid;
+	ns->sectors = parse_sectors(sysfs_read(fd, "size", buf, sizeof(buf)));
+	ns->vendor = "-";
+	ns->model = ctrl->mn;
+	ns->rev = ctrl->fr;
+
+	if (sysfs_read(fd, "nsid", buf, sizeof(buf)))
+		ns->nsid = strtoul(buf, NULL, 0);
+	else
+		ns->nsid = strtoul(ns->sysnum, NULL, 10);
+
+	sd.ctrl = ctrl;
+	sd.disk = ns - ctrl->ns;
+	sysfs_for_each(fd, name, sysfs_add_part, &sd);
+
+	close(fd);
+}
+
+static int ctrl_cmp(const void *a, const void *b)
+{
+	const struct lsnvme_ctrl *x = a, *y = b;
+
+	return strverscmp(x->sysname, y->sysname);
+}
+
+static int sysfs_ns_cmp(const void *a, const void *b)
+{
+	const struct lsnvme_ns *x = a, *y = b;
+
+	return strverscmp(x->sysname, y->sysname);
+}
+
+static void lsnvme_sysfs_enum_ctrl(void)
+{
+	if (sysfs_open_dirs())
+		return;
+
+	sysfs_for_each(sysfs_class_fd, NVME, sysfs_add_ctrl, NULL);
+
+	/* getdents order is hash order, list like udev does */
+	qsort(ctrls, nr_ctrls, sizeof(*ctrls), ctrl_cmp);
+}
+
+static void lsnvme_sysfs_enum_devs(void)
+{
+	unsigned int i;
+
+	if (sysfs_block_fd < 0)
+		return;
+
+	sysfs_for_each(sysfs_block_fd, NVME, sysfs_add_disk, NULL);
+
+	for (i = 0; i < nr_ctrls; ++i)
+		qsort(ctrls[i].ns, ctrls[i].nr_ns, sizeof(*ctrls[i].ns),
+		      sysfs_ns_cmp);
+}
+
+static void lsnvme_free_ctrls(void)
+{
+	unsigned int i, n;
+
+	for (i = 0; i < nr_ctrls; ++i) {
+		for (n = 0; n < ctrls[i].nr_ns; ++n) {
+			if (ctrls[i].ns[n].dev)
+				udev_device_unref(ctrls[i].ns[n].dev);
+			free(ctrls[i].ns[n].id);
+			free(ctrls[i].ns[n].probe);
+		}
+		free(ctrls[i].ns);
+		free(ctrls[i].active);
+		free(ctrls[i].id);
+		free(ctrls[i].smart[0]);
+		free(ctrls[i].smart[1]);
+		free(ctrls[i].errs);
+		free(ctrls[i].fw);
+		free(ctrls[i].apst);
+		if (ctrls[i].dev)
+			udev_device_unref(ctrls[i].dev);
+	}
+
+	free(ctrls);
+	ctrls = NULL;
+	nr_ctrls = next_ctrl = 0;
+}
+
+/* build the device model: enumerate, then run the Identify workers */
+static void lsnvme_collect(void)
+{
+	if (opts.backend == BACKEND_SYSFS)
+		lsnvme_sysfs_enum_ctrl();
+	else
+		lsnvme_udev_enum_ctrl();
+
+	if (opts.disp_devs) {
+		if (opts.backend == BACKEND_SYSFS)
+			lsnvme_sysfs_enum_devs();
+		else
+			lsnvme_udev_enum_devs();
+	}
+
+	if (opts.verbose || opts.active_ns)
+		lsnvme_for_each_ctrl(lsnvme_identify_one);
+}
+
+static void lsnvme_print_all(void)
+{
+	struct lsnvme_ctrl *ctrl;
+	unsigned int i, n;
+
+	for (i = 0; i < nr_ctrls; ++i) {
+		ctrl = &ctrls[i];
+
+		if (opts.disp_ctrl)
+			lsnvme_printctrl(ctrl);
+
+		if (opts.active_ns && opts.disp_devs && ctrl->list_ret)
+			fprintf(stderr, "%sactive namespace list failed on: %s\n",
+				TAB, ctrl->devnode);
+
+		for (n = 0; n < ctrl->nr_ns; ++n)
+			if (ctrl->ns[n].is_part)
+				lsnvme_printpart(&ctrl->ns[n], "");
+			else
+				lsnvme_printbd(&ctrl->ns[n],
+					       opts.disp_ctrl ? TAB : "");
+	}
+}
+
+/*
+ * -f bin: the whole inventory as one snapshot, laid out as described in
+ * lsnvme_snap.h. Tables and the string pool are built in memory first so
+ * the header can carry final offsets, then everything goes out through
+ * the output buffer in file order.
+ */
+struct snap_pool {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static uint32_t snap_str(struct snap_pool *p, const char *s)
+{
+	size_t len, size;
+	uint32_t off;
+	char *buf;
+
+	if (!s || !*s || strcmp(s, "-") == 0)
+		return 0;
+
+	len = strlen(s) + 1;
+	if (p->len + len > p->size) {
+		for (size = p->size * 2; size < p->len + len; size *= 2)
+			;
+		buf = realloc(p->buf, size);
+		if (!buf)
+			return 0;
+		p->buf = buf;
+		p->size = size;
+	}
+
+	off = p->len;
+	memcpy(p->buf + off, s, len);
+	p->len += len;
+
+	return htole32(off);
+}
+
+static uint32_t snap_num(const char *s)
+{
+	return htole32(s ? strtoul(s, NULL, 10) : 0);
+}
+
+static void out_bytes(const void *p, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = len < OUT_BUF_SZ ? len : OUT_BUF_SZ;
+		out_puts(p, n);
+		p = (const char *)p + n;
+		len -= n;
+	}
+}
+
+static int lsnvme_snap_write(void)
+{
+	static const char pad[8];
+	struct lsnvme_snap_hdr hdr = { { 0 } };
+	struct lsnvme_snap_ctrl *sc;
+	struct lsnvme_snap_ns *sn;
+	struct snap_pool pool = { NULL, 1, 4096 };
+	struct lsnvme_ctrl *ctrl;
+	struct lsnvme_ns *ns;
+	unsigned int i, n, nr_ns = 0, idx = 0;
+	uint64_t off;
+
+	for (i = 0; i < nr_ctrls; ++i)
+		nr_ns += ctrls[i].nr_ns;
+
+	sc = calloc(nr_ctrls ? nr_ctrls : 1, sizeof(*sc));
+	sn = calloc(nr_ns ? nr_ns : 1, sizeof(*sn));
+	pool.buf = calloc(1, pool.size);
+	if (!sc || !sn || !pool.buf) {
+		fprintf(stderr, "out of memory building snapshot\n");
+		free(sc);
+		free(sn);
+		free(pool.buf);
+		return EXIT_FAILURE;
+	}
+
+	/* Identify pages follow the tables, in table order */
+	off = sizeof(hdr) + (uint64_t)nr_ctrls * sizeof(*sc) +
+	      (uint64_t)nr_ns * sizeof(*sn);
+
+	for (i = 0; i < nr_ctrls; ++i) {
+		ctrl = &ctrls[i];
+
+		sc[i].instance = snap_num(ctrl->sysnum);
+		sc[i].first_ns = htole32(idx);
+		sc[i].nr_ns = htole32(ctrl->nr_ns);
+		sc[i].devnum = htole64(ctrl->devnum);
+		if (ctrl->id && !ctrl->id_ret) {
+			sc[i].id_off = htole64(off);
+			off += LSNVME_SNAP_PAGE;
+		}
+		sc[i].devnode = snap_str(&pool, ctrl->devnode);
+		sc[i].vendor = snap_str(&pool, ctrl->vendor);
+		sc[i].model = snap_str(&pool, ctrl->model);
+		sc[i].bus = snap_str(&pool, ctrl->subsystem);
+		sc[i].driver = snap_str(&pool, ctrl->driver);
+		sc[i].serial = snap_str(&pool, ctrl->sn);
+		sc[i].firmware = snap_str(&pool, ctrl->fr);
+		sc[i].model_number = snap_str(&pool, ctrl->mn);
+
+		for (n = 0; n < ctrl->nr_ns; ++n, ++idx) {
+			ns = &ctrl->ns[n];
+
+			sn[idx].ctrl = htole32(i);
+			sn[idx].nsid = htole32(ns->nsid);
+			sn[idx].instance = snap_num(ns->is_part ?
+						    ns->disk_sysnum :
+						    ns->sysnum);
+			sn[idx].partno = htole32(ns->is_part ? ns->partno : 0);
+			sn[idx].flags = htole32(
+				(ns->is_part ? LSNVME_SNAP_PART : 0) |
+				(ns->devnode ? 0 : LSNVME_SNAP_NO_BLKDEV));
+			sn[idx].devnode = snap_str(&pool, ns->devnode);
+			sn[idx].size = htole64(ns->sectors < 0 ? UINT64_MAX :
+					       (uint64_t)ns->sectors * 512);
+			if (ns->id && !ns->id_ret) {
+				sn[idx].id_off = htole64(off);
+				off += LSNVME_SNAP_PAGE;
+			}
+		}
+	}
+
+	memcpy(hdr.magic, LSNVME_SNAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(LSNVME_SNAP_VERSION);
+	hdr.hdr_size = htole32(sizeof(hdr));
+	hdr.created = htole64(time(NULL));
+	hdr.nr_ctrls = htole32(nr_ctrls);
+	hdr.nr_ns = htole32(nr_ns);
+	hdr.ctrl_off = htole64(sizeof(hdr));
+	hdr.ns_off = htole64(sizeof(hdr) + (uint64_t)nr_ctrls * sizeof(*sc));
+	hdr.str_off = htole64(off);
+	hdr.str_size = htole64(pool.len);
+	hdr.file_size = htole64(off + ((pool.len + 7) & ~7ULL));
+	gethostname(hdr.hostname, sizeof(hdr.hostname) - 1);
+
+	out_bytes(&hdr, sizeof(hdr));
+	out_bytes(sc, (size_t)nr_ctrls * sizeof(*sc));
+	out_bytes(sn, (size_t)nr_ns * sizeof(*sn));
+
+	for (i = 0; i < nr_ctrls; ++i) {
+		ctrl = &ctrls[i];
+		if (ctrl->id && !ctrl->id_ret)
+			out_bytes(ctrl->id, LSNVME_SNAP_PAGE);
+		for (n = 0; n < ctrl->nr_ns; ++n)
+			if (ctrl->ns[n].id && !ctrl->ns[n].id_ret)
+				out_bytes(ctrl->ns[n].id, LSNVME_SNAP_PAGE);
+	}
+
+	out_bytes(pool.buf, pool.len);
+	out_bytes(pad, -pool.len & 7);
+
+	free(sc);
+	free(sn);
+	free(pool.buf);
+
+	return EXIT_SUCCESS;
+}
+
+/* --admin-stats: round trip histogram of every controller we talked to */
+static void lsnvme_print_admin_stats(struct lsnvme_ctrl *ctrl)
+{
+	struct lsnvme_handle *h = lsnvme_dev_find(ctrl->devnum);
+	double avg;
+	unsigned int b;
+
+	if (!h || !h->admin_cmds)
+		return;
+
+	avg = h->admin_ns / 1e3 / h->admin_cmds;
+
+	if (opts.format != FMT_TEXT) {
+		struct out_field f[] = {
+			f_num("ctrl", ctrl->sysnum),
+			F_STR("dev", ctrl->devnode),
+			F_U64("cmds", h->admin_cmds),
+			F_U64("errors", h->admin_errs),
+			F_DBL("avg_us", avg),
+			F_DBL("max_us", h->admin_max_ns / 1e3),
+		};
+		struct out_field hf[] = {
+			f_num("ctrl", ctrl->sysnum),
+			F_U64("lo_us", 0),
+			F_U64("hi_us", 0),
+			F_U64("count", 0),
+		};
+
+		out_record("admin_stats", f, sizeof(f) / sizeof(f[0]));
+		for (b = 0; b < ADMIN_HIST; ++b) {
+			if (!h->admin_hist[b])
+				continue;
+			hf[1].u = b ? 1ULL << (b - 1) : 0;
+			hf[2].u = 1ULL << b;
+			hf[3].u = h->admin_hist[b];
+			out_record("admin_hist", hf, sizeof(hf) / sizeof(hf[0]));
+		}
+		return;
+	}
+
+	printf("[%s]\t%s\t%"PRIu64" cmds\t%"PRIu64" errors\t"
+	       "avg %.1fus\tmax %.1fus\n",
+		ctrl->sysnum, ctrl->devnode, h->admin_cmds, h->admin_errs,
+		avg, h->admin_max_ns / 1e3);
+
+	for (b = 0; b < ADMIN_HIST; ++b)
+		if (h->admin_hist[b])
+			printf("%s%llu-%lluus\t%"PRIu64"\n", TAB,
+				b ? 1ULL << (b - 1) : 0ULL, (1ULL << b) - 1,
+				h->admin_hist[b]);
+}
+
+static int lsnvme_enum_ctrl(void)
+{
+	int ret = EXIT_SUCCESS;
+	unsigned int i;
+
+	lsnvme_collect();
+	if (opts.format == FMT_BIN)
+		ret = lsnvme_snap_write();
+	else
+		lsnvme_print_all();
+
+	for (i = 0; opts.admin_stats && i < nr_ctrls; ++i)
+		lsnvme_print_admin_stats(&ctrls[i]);
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return ret;
+}
+
+/*
+ * The long running modes end on SIGINT/SIGTERM. No SA_RESTART, so the
+ * signal also breaks them out of poll() and nanosleep().
+ */
+static volatile sig_atomic_t stop;
+
+static void stop_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void catch_stop_signals(void)
+{
+	struct sigaction sa = { .sa_handler = stop_signal };
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* sleep until t (CLOCK_MONOTONIC seconds) unless a signal stops us */
+static void sleep_until(double t)
+{
+	struct timespec ts = {
+		.tv_sec = (time_t)t,
+		.tv_nsec = (long)((t - (time_t)t) * 1e9),
+	};
+
+	while (!stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&ts, NULL) == EINTR)
+		;
+}
+
+/*
+ * SMART polling: the health log of every controller is fetched once per
+ * interval and the 128-bit counters are turned into per-interval rates.
+ * Data units are 1000 512-byte blocks, busy time is in minutes, so the
+ * busy percentage only moves in whole minutes.
+ */
+static void lsnvme_smart_one(struct lsnvme_ctrl *ctrl)
+{
+	struct nvme_smart_log *tmp;
+
+	if (!ctrl->smart[0]) {
+		ctrl->smart[0] = calloc(1, sizeof(*ctrl->smart[0]));
+		ctrl->smart[1] = calloc(1, sizeof(*ctrl->smart[1]));
+		if (!ctrl->smart[0] || !ctrl->smart[1]) {
+			ctrl->smart_ret = ENOMEM;
+			return;
+		}
+	}
+
+	/* smart[1] keeps the previous sample */
+	tmp = ctrl->smart[1];
+	ctrl->smart[1] = ctrl->smart[0];
+	ctrl->smart[0] = tmp;
+	ctrl->smart_prev_ret = ctrl->smart_ret;
+
+	ctrl->smart_ret = lsnvme_get_log(
+		lsnvme_dev_get(ctrl->devnum, ctrl->devnode), 0xffffffff,
+		NVME_LOG_SMART, ctrl->smart[0], sizeof(*ctrl->smart[0]));
+}
+
+static long double smart_delta(const __u8 *cur, const __u8 *prev)
+{
+	return le128(cur) - le128(prev);
+}
+
+static void lsnvme_print_smart(struct lsnvme_ctrl *ctrl, double dt)
+{
+	struct nvme_smart_log *cur = ctrl->smart[0], *prev = ctrl->smart[1];
+	unsigned int temp;
+
+	if (ctrl->smart_ret) {
+		fprintf(stderr, "%slog page failed on: %s\n",
+			TAB, ctrl->devnode);
+		return;
+	}
+
+	temp = cur->temperature[0] | cur->temperature[1] << 8;
+
+	if (opts.format != FMT_TEXT) {
+		bool rates = !ctrl->smart_prev_ret && dt > 0;
+		struct out_field f[] = {
+			f_num("ctrl", ctrl->sysnum),
+			F_STR("dev", ctrl->devnode),
+			F_DBL("read_mbps", smart_delta(cur->data_units_read,
+				prev->data_units_read) * 512000 / 1e6 / dt),
+			F_DBL("write_mbps", smart_delta(cur->data_units_written,
+				prev->data_units_written) * 512000 / 1e6 / dt),
+			F_DBL("read_iops", smart_delta(cur->host_reads,
+				prev->host_reads) / dt),
+			F_DBL("write_iops", smart_delta(cur->host_writes,
+				prev->host_writes) / dt),
+			F_DBL("busy_pct", smart_delta(cur->ctrl_busy_time,
+				prev->ctrl_busy_time) * 60 * 100 / dt),
+			F_U64("temp_c", temp - 273),
+		};
+
+		for (unsigned int i = 2; !rates && i < 7; ++i)
+			f[i] = (struct out_field)F_NULL(f[i].key);
+		if (temp < 273)
+			f[7] = (struct out_field)F_NULL("temp_c");
+		out_record("smart", f, sizeof(f) / sizeof(f[0]));
+		return;
+	}
+
+	if (ctrl->smart_prev_ret || dt <= 0) {
+		printf("[%s]\t%s\t-\t-\t-\t-\t-\t%dC\n",
+			ctrl->sysnum, ctrl->devnode, (int)temp - 273);
+		return;
+	}
+
+	printf("[%s]\t%s\t%.2Lf\t%.2Lf\t%.0Lf\t%.0Lf\t%.1Lf\t%dC\n",
+		ctrl->sysnum, ctrl->devnode,
+		smart_delta(cur->data_units_read, prev->data_units_read)
+			* 512000 / 1e6 / dt,
+		smart_delta(cur->data_units_written, prev->data_units_written)
+			* 512000 / 1e6 / dt,
+		smart_delta(cur->host_reads, prev->host_reads) / dt,
+		smart_delta(cur->host_writes, prev->host_writes) / dt,
+		smart_delta(cur->ctrl_busy_time, prev->ctrl_busy_time)
+			* 60 * 100 / dt,
+		(int)temp - 273);
+}
+
+static int lsnvme_smart(void)
+{
+	double last, t;
+	unsigned int i;
+
+	catch_stop_signals();
+
+	opts.disp_devs = false;
+	lsnvme_collect();
+
+	lsnvme_for_each_ctrl(lsnvme_smart_one);
+	last = now();
+
+	while (!stop) {
+		sleep_until(last + opts.smart_interval);
+		if (stop)
+			break;
+
+		lsnvme_for_each_ctrl(lsnvme_smart_one);
+		t = now();
+
+		if (opts.format == FMT_TEXT)
+			printf("[dev]\tdev\trMB/s\twMB/s\trIOPS\twIOPS\t"
+			       "busy%%\ttemp\n");
+		for (i = 0; i < nr_ctrls; ++i)
+			lsnvme_print_smart(&ctrls[i], t - last);
+		out_flush();
+		fflush(stdout);
+
+		last = t;
+	}
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --iostat: block layer counters of every namespace and partition. The
+ * stat files are opened once after enumeration and re-read with pread
+ * each interval, one syscall per device and tick. Fields, see
+ * Documentation/block/stat.rst: read I/Os, merges, sectors, ticks (ms),
+ * the same for writes, in flight, io_ticks and time_in_queue.
+ */
+enum {
+	ST_RIOS, ST_RMERGE, ST_RSECT, ST_RTICKS,
+	ST_WIOS, ST_WMERGE, ST_WSECT, ST_WTICKS,
+	ST_INFLIGHT, ST_IOTICKS, ST_QTIME,
+	ST_NR,
+};
+
+struct iostat_dev {
+	struct lsnvme_ns *ns;
+	const char *disk_sysnum;	/* partitions only */
+	int fd;
+	bool valid;
+	uint64_t st[ST_NR];
+};
+
+static bool iostat_read(struct iostat_dev *d, uint64_t *st)
+{
+	char buf[512];
+	ssize_t n;
+	char *p = buf, *end;
+	unsigned int i;
+
+	n = pread(d->fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return false;
+	buf[n] = 0;
+
+	for (i = 0; i < ST_NR; ++i, p = end) {
+		st[i] = strtoull(p, &end, 10);
+		if (end == p)
+			return false;
+	}
+
+	return true;
+}
+
+static void iostat_open(struct iostat_dev *d, struct lsnvme_ctrl *ctrl)
+{
+	struct lsnvme_ns *ns = d->ns, *disk = NULL;
+	char path[PATH_MAX];
+	unsigned int i;
+
+	d->fd = -1;
+	if (ns->is_part) {
+		for (i = 0; i < ctrl->nr_ns && !disk; ++i)
+			if (!ctrl->ns[i].is_part && ctrl->ns[i].sysnum &&
+			    !strcmp(ctrl->ns[i].sysnum, ns->disk_sysnum))
+				disk = &ctrl->ns[i];
+		if (!disk)
+			return;
+		snprintf(path, sizeof(path), "%s/block/%s/%s/stat",
+			 SYS, disk->sysname, ns->sysname);
+	} else {
+		snprintf(path, sizeof(path), "%s/block/%s/stat",
+			 SYS, ns->sysname);
+	}
+
+	d->fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (d->fd >= 0)
+		d->valid = iostat_read(d, d->st);
+}
+
+static void lsnvme_print_iostat(struct iostat_dev *d, const uint64_t *st,
+				double secs)
+{
+	struct lsnvme_ns *ns = d->ns;
+	uint64_t dst[ST_NR];
+	double ios, await, aqu, util;
+	unsigned int i;
+
+	for (i = 0; i < ST_NR; ++i)
+		dst[i] = st[i] - d->st[i];
+
+	ios = dst[ST_RIOS] + dst[ST_WIOS];
+	await = ios ? (dst[ST_RTICKS] + dst[ST_WTICKS]) / ios : 0;
+	aqu = dst[ST_QTIME] / (secs * 1000);
+	util = dst[ST_IOTICKS] / (secs * 10);
+	if (util > 100)
+		util = 100;
+
+	if (opts.format != FMT_TEXT) {
+		struct out_field f[] = {
+			f_num("ctrl", ns->ctrl_sysnum),
+			f_num("ns", ns->is_part ? ns->disk_sysnum : ns->sysnum),
+			f_num("part", ns->is_part ? ns->sysnum : NULL),
+			F_STR("dev", ns->devnode),
+			F_STR("model", ns->model),
+			F_DBL("r_iops", dst[ST_RIOS] / secs),
+			F_DBL("w_iops", dst[ST_WIOS] / secs),
+			F_DBL("r_mbs", dst[ST_RSECT] * 512 / secs / 1e6),
+			F_DBL("w_mbs", dst[ST_WSECT] * 512 / secs / 1e6),
+			F_DBL("await_ms", await),
+			F_DBL("aqu", aqu),
+			F_DBL("util", util),
+		};
+
+		out_record("iostat", f, sizeof(f) / sizeof(f[0]));
+		return;
+	}
+
+	if (ns->is_part)
+		printf("[%s:%s:%s]", ns->ctrl_sysnum, ns->disk_sysnum,
+			ns->sysnum);
+	else
+		printf("[%s:%s]", ns->ctrl_sysnum, ns->sysnum);
+	printf("\t%s\t%.0f\t%.0f\t%.1f\t%.1f\t%.2f\t%.2f\t%.1f\t%s\n",
+		ns->devnode, dst[ST_RIOS] / secs, dst[ST_WIOS] / secs,
+		dst[ST_RSECT] * 512 / secs / 1e6,
+		dst[ST_WSECT] * 512 / secs / 1e6,
+		await, aqu, util, ns->model ? ns->model : "-");
+}
+
+static int lsnvme_iostat(void)
+{
+	struct iostat_dev *devs = NULL, *d;
+	uint64_t st[ST_NR];
+	unsigned int i, n, nr = 0;
+	double last, t;
+
+	catch_stop_signals();
+
+	lsnvme_collect();
+
+	for (i = 0; i < nr_ctrls; ++i)
+		for (n = 0; n < ctrls[i].nr_ns; ++n) {
+			if (!ctrls[i].ns[n].sysname)
+				continue;
+
+			d = array_grow(devs, nr, sizeof(*devs));
+			if (!d)
+				break;
+			devs = d;
+			d = &devs[nr];
+			memset(d, 0, sizeof(*d));
+			d->ns = &ctrls[i].ns[n];
+			iostat_open(d, &ctrls[i]);
+			if (d->fd < 0)
+				fprintf(stderr, "%sno stat for: %s\n", TAB,
+					d->ns->devnode);
+			else
+				nr++;
+		}
+	last = now();
+
+	while (!stop) {
+		sleep_until(last + opts.iostat_interval);
+		if (stop)
+			break;
+		t = now();
+
+		if (opts.format == FMT_TEXT)
+			printf("[dev]\tdev\tr/s\tw/s\trMB/s\twMB/s\tawait\t"
+			       "aqu\tutil%%\tmodel\n");
+		for (i = 0; i < nr; ++i) {
+			if (!iostat_read(&devs[i], st)) {
+				devs[i].valid = false;
+				continue;
+			}
+			/* counters of a device that went away and came back */
+			if (devs[i].valid)
+				lsnvme_print_iostat(&devs[i], st, t - last);
+			memcpy(devs[i].st, st, sizeof(st));
+			devs[i].valid = true;
+		}
+		out_flush();
+		fflush(stdout);
+
+		last = t;
+	}
+
+	for (i = 0; i < nr; ++i)
+		close(devs[i].fd);
+	free(devs);
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --probe-latency: timed single block reads at random LBAs below nsze,
+ * one at a time, on every namespace. Only Read commands are ever built,
+ * and the ioctl transport opens block devices read-only. Formats with
+ * metadata get room for it, inline after the data for extended LBAs and
+ * in a separate buffer otherwise.
+ */
+struct lsnvme_probe {
+	int ret;
+	unsigned int nr;	/* reads that completed */
+	unsigned int lba_size;
+	double p50, p99, p999, max;	/* microseconds */
+};
+
+static int dbl_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of a sorted array */
+static double percentile(const double *v, unsigned int nr, double p)
+{
+	double rank = p * nr;
+	unsigned int i = rank;
+
+	if (i < rank)
+		++i;
+	return v[i ? i - 1 : 0];
+}
+
+static uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static void lsnvme_probe_ns(struct lsnvme_ns *ns, struct lsnvme_probe *probe)
+{
+	struct nvme_user_io io = { .opcode = nvme_cmd_read };
+	struct lsnvme_handle *h;
+	uint64_t nsze, seed;
+	unsigned int ds, ms;
+	double *lat, t;
+	void *buf, *meta = NULL;
+	bool ext;
+
+	if (!ns->id)
+		lsnvme_identify_ns_one(ns);
+	if (ns->id_ret) {
+		probe->ret = ns->id_ret;
+		return;
+	}
+
+	nsze = le64toh(ns->id->nsze);
+	ds = ns->id->lbaf[ns->id->flbas & 0xf].ds;
+	ms = le16toh(ns->id->lbaf[ns->id->flbas & 0xf].ms);
+	ext = ns->id->flbas & 0x10;	/* metadata at the end of the LBA */
+	if (!nsze || ds < 9 || ds > 16) {
+		probe->ret = EINVAL;
+		return;
+	}
+	probe->lba_size = 1U << ds;
+
+	lat = malloc(opts.probe_reads * sizeof(*lat));
+	if (!lat || posix_memalign(&buf, 4096,
+				   probe->lba_size + (ext ? ms : 0))) {
+		free(lat);
+		probe->ret = ENOMEM;
+		return;
+	}
+	if (ms && !ext && posix_memalign(&meta, 4096, ms)) {
+		free(buf);
+		free(lat);
+		probe->ret = ENOMEM;
+		return;
+	}
+
+	h = lsnvme_dev_get(ns->devnum, ns->devnode);
+	seed = ((uint64_t)ns->devnum << 32 | (uint64_t)time(NULL)) | 1;
+	io.addr = (uint64_t)(uintptr_t)buf;
+	io.metadata = (uint64_t)(uintptr_t)meta;
+
+	while (probe->nr < opts.probe_reads && !stop) {
+		io.slba = xorshift64(&seed) % nsze;
+		t = now();
+		probe->ret = lsnvme_io(h, &io);
+		t = now() - t;
+		if (probe->ret)
+			break;
+		lat[probe->nr++] = t * 1e6;
+	}
+
+	if (probe->nr) {
+		qsort(lat, probe->nr, sizeof(*lat), dbl_cmp);
+		probe->p50 = percentile(lat, probe->nr, 0.5);
+		probe->p99 = percentile(lat, probe->nr, 0.99);
+		probe->p999 = percentile(lat, probe->nr, 0.999);
+		probe->max = lat[probe->nr - 1];
+	}
+
+	free(meta);
+	free(buf);
+	free(lat);
+}
+
+static void lsnvme_probe_one(struct lsnvme_ctrl *ctrl)
+{
+	struct lsnvme_ns *ns;
+	unsigned int n;
+
+	for (n = 0; n < ctrl->nr_ns; ++n) {
+		ns = &ctrl->ns[n];
+		if (ns->is_part || !ns->devnode)
+			continue;
+
+		ns->probe = calloc(1, sizeof(*ns->probe));
+		if (ns->probe)
+			lsnvme_probe_ns(ns, ns->probe);
+	}
+}
+
+static void lsnvme_print_probe(struct lsnvme_ns *ns)
+{
+	struct lsnvme_probe *p = ns->probe;
+
+	if (p->ret && !p->nr) {
+		fprintf(stderr, "%sread probe failed on: %s\n",
+			TAB, ns->devnode);
+		return;
+	}
+
+	if (opts.format != FMT_TEXT) {
+		struct out_field f[] = {
+			f_num("ctrl", ns->ctrl_sysnum),
+			f_num("ns", ns->sysnum),
+			F_U64("nsid", ns->nsid),
+			F_STR("dev", ns->devnode),
+			F_U64("lba_size", p->lba_size),
+			F_U64("reads", p->nr),
+			F_DBL("p50_us", p->p50),
+			F_DBL("p99_us", p->p99),
+			F_DBL("p999_us", p->p999),
+			F_DBL("max_us", p->max),
+		};
+
+		out_record("probe", f, sizeof(f) / sizeof(f[0]));
+		return;
+	}
+
+	printf("[%s:%s]\t%s\t%u\t%.1f\t%.1f\t%.1f\t%.1f\n",
+		ns->ctrl_sysnum, ns->sysnum, ns->devnode, p->nr,
+		p->p50, p->p99, p->p999, p->max);
+}
+
+static int lsnvme_probe(void)
+{
+	unsigned int i, n;
+
+	catch_stop_signals();
+
+	lsnvme_collect();
+	lsnvme_for_each_ctrl(lsnvme_probe_one);
+
+	if (opts.format == FMT_TEXT)
+		printf("[dev]\tdev\treads\tp50us\tp99us\tp99.9us\tmaxus\n");
+	for (i = 0; i < nr_ctrls; ++i)
+		for (n = 0; n < ctrls[i].nr_ns; ++n)
+			if (ctrls[i].ns[n].probe)
+				lsnvme_print_probe(&ctrls[i].ns[n]);
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --qd-sweep: random reads through io_uring at increasing queue depth on
+ * every namespace, one namespace at a time. The ring is driven with raw
+ * syscalls, buffers are registered once and read with READ_FIXED, and the
+ * block device is opened O_DIRECT so the page cache stays out of it.
+ */
+static const unsigned int qd_steps[] = { 1, 4, 16, 64, 256 };
+#define QD_MAX	256
+
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+static void uring_exit(struct uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_len);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_len);
+	close(r->fd);
+}
+
+/* returns 0 or a positive errno */
+static int uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p = { 0 };
+	unsigned char *sq, *cq;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return errno;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP && r->cq_len > r->sq_len)
+		r->sq_len = r->cq_len;
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_ring = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE,
+				  MAP_SHARED|MAP_POPULATE, r->fd,
+				  IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq_ring;
+	cq = r->cq_ring;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+fail:
+	if (r->sq_ring == MAP_FAILED)
+		r->sq_ring = NULL;
+	if (r->cq_ring == MAP_FAILED)
+		r->cq_ring = NULL;
+	if (r->sqes == MAP_FAILED)
+		r->sqes = NULL;
+	err = errno;
+	uring_exit(r);
+	return err;
+}
+
+static void uring_read_fixed(struct uring *r, int fd, void *buf,
+			     unsigned int len, uint64_t off, unsigned int idx)
+{
+	unsigned int tail = *r->sq_tail, i = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->buf_index = idx;
+	sqe->user_data = idx;
+
+	r->sq_array[i] = i;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+struct qd_result {
+	int ret;
+	unsigned int qd;
+	double iops;
+	double p50, p99, p999, max;	/* microseconds */
+};
+
+struct qd_run {
+	struct uring ring;
+	int fd;
+	unsigned int bs;
+	uint64_t nr_blocks;
+	uint64_t seed;
+	unsigned char *bufs;
+	double issued[QD_MAX];
+	double *lat;
+	size_t nr_lat, max_lat;
+};
+
+/*
+ * Wait for the reads the kernel still has after io_uring_enter failed:
+ * their registered buffers may be written until they complete, so the
+ * ring and the buffers must not go away before. Reads still sitting in
+ * the submission queue were never seen by the kernel.
+ */
+static void qd_drain(struct qd_run *run, unsigned int inflight)
+{
+	struct uring *r = &run->ring;
+	struct timespec ts = { 0, 1000000 };
+	unsigned int head;
+
+	inflight -= *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	while (inflight) {
+		head = *r->cq_head;
+		while (inflight &&
+		       head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			++head;
+			--inflight;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		if (!inflight)
+			break;
+
+		/* completions land in the CQ ring even if enter keeps failing */
+		if (syscall(__NR_io_uring_enter, r->fd, 0, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+			nanosleep(&ts, NULL);
+	}
+}
+
+static int qd_step(struct qd_run *run, unsigned int qd, struct qd_result *res)
+{
+	struct uring *r = &run->ring;
+	unsigned int i, head, idx, submit = 0, inflight = 0;
+	double start, end, t;
+	double *tmp;
+	size_t max;
+	int ret = 0;
+
+	run->nr_lat = 0;
+	start = now();
+	end = start + opts.qd_secs;
+
+	for (i = 0; i < qd; ++i) {
+		uring_read_fixed(r, run->fd, run->bufs + (size_t)i * run->bs,
+				 run->bs, xorshift64(&run->seed) %
+				 run->nr_blocks * run->bs, i);
+		run->issued[i] = start;
+		++submit;
+		++inflight;
+	}
+
+	while (inflight) {
+		if (syscall(__NR_io_uring_enter, r->fd, submit, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = errno;
+			qd_drain(run, inflight);
+			break;
+		}
+		submit = 0;
+
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+			t = now();
+			idx = cqe->user_data;
+			if (cqe->res < 0 && !ret)
+				ret = -cqe->res;
+			++head;
+			--inflight;
+
+			if (run->nr_lat == run->max_lat) {
+				max = run->max_lat ? run->max_lat * 2 : 4096;
+				tmp = realloc(run->lat, max * sizeof(*run->lat));
+				if (!tmp) {
+					/* stop issuing, keep reaping */
+					if (!ret)
+						ret = ENOMEM;
+					continue;
+				}
+				run->lat = tmp;
+				run->max_lat = max;
+			}
+			run->lat[run->nr_lat++] = (t - run->issued[idx]) * 1e6;
+
+			if (ret || stop || t >= end)
+				continue;
+
+			uring_read_fixed(r, run->fd,
+					 run->bufs + (size_t)idx * run->bs,
+					 run->bs, xorshift64(&run->seed) %
+					 run->nr_blocks * run->bs, idx);
+			run->issued[idx] = t;
+			++submit;
+			++inflight;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	res->qd = qd;
+	res->ret = ret;
+	if (ret || !run->nr_lat)
+		return ret ? ret : EIO;
+
+	t = now() - start;
+	qsort(run->lat, run->nr_lat, sizeof(*run->lat), dbl_cmp);
+	res->iops = run->nr_lat / t;
+	res->p50 = percentile(run->lat, run->nr_lat, 0.5);
+	res->p99 = percentile(run->lat, run->nr_lat, 0.99);
+	res->p999 = percentile(run->lat, run->nr_lat, 0.999);
+	res->max = run->lat[run->nr_lat - 1];
+
+	return 0;
+}
+
+static void lsnvme_print_qd(struct lsnvme_ns *ns, struct qd_result *res,
+			    int rp)
+{
+	if (opts.format != FMT_TEXT) {
+		struct out_field f[] = {
+			f_num("ctrl", ns->ctrl_sysnum),
+			f_num("ns", ns->sysnum),
+			F_U64("nsid", ns->nsid),
+			F_STR("dev", ns->devnode),
+			F_U64("qd", res->qd),
+			F_DBL("iops", res->iops),
+			F_DBL("p50_us", res->p50),
+			F_DBL("p99_us", res->p99),
+			F_DBL("p999_us", res->p999),
+			F_DBL("max_us", res->max),
+			F_U64("lbaf_rp", rp),
+		};
+
+		if (rp < 0)
+			f[10] = (struct out_field)F_NULL("lbaf_rp");
+		out_record("qd", f, sizeof(f) / sizeof(f[0]));
+		out_flush();
+		return;
+	}
+
+	printf("[%s:%s]\t%s\t%u\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t",
+		ns->ctrl_sysnum, ns->sysnum, ns->devnode, res->qd, res->iops,
+		res->p50, res->p99, res->p999, res->max);
+	if (rp < 0)
+		printf("-\n");
+	else
+		printf("%d\n", rp);
+	fflush(stdout);
+}
+
+static void lsnvme_qd_sweep_ns(struct lsnvme_ns *ns)
+{
+	struct qd_run run = { .fd = -1 };
+	struct qd_result res;
+	struct iovec iov[QD_MAX];
+	unsigned int i;
+	int rp = -1, ret;
+
+	run.bs = 4096;
+	if (opts.verbose && !ns->id)
+		lsnvme_identify_ns_one(ns);
+	if (ns->id && !ns->id_ret) {
+		struct nvme_lbaf *lbaf = &ns->id->lbaf[ns->id->flbas & 0xf];
+
+		rp = lbaf->rp & 3;
+		if (lbaf->ds > 12 && lbaf->ds <= 16)
+			run.bs = 1U << lbaf->ds;
+	}
+
+	if (ns->sectors <= 0 || (uint64_t)ns->sectors * 512 < run.bs) {
+		fprintf(stderr, "%sno usable size for: %s\n", TAB, ns->devnode);
+		return;
+	}
+	run.nr_blocks = (uint64_t)ns->sectors * 512 / run.bs;
+	run.seed = ((uint64_t)ns->devnum << 32 | (uint64_t)time(NULL)) | 1;
+
+	run.fd = open(ns->devnode, O_RDONLY|O_DIRECT|O_CLOEXEC);
+	if (run.fd < 0) {
+		perror(ns->devnode);
+		return;
+	}
+
+	ret = uring_init(&run.ring, QD_MAX);
+	if (ret) {
+		fprintf(stderr, "%sio_uring setup failed: %s\n", TAB,
+			strerror(ret));
+		close(run.fd);
+		return;
+	}
+
+	if (posix_memalign((void **)&run.bufs, 4096, (size_t)QD_MAX * run.bs)) {
+		ret = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < QD_MAX; ++i) {
+		iov[i].iov_base = run.bufs + (size_t)i * run.bs;
+		iov[i].iov_len = run.bs;
+	}
+	if (syscall(__NR_io_uring_register, run.ring.fd,
+		    IORING_REGISTER_BUFFERS, iov, QD_MAX) < 0) {
+		ret = errno;
+		goto out;
+	}
+
+	for (i = 0; i < sizeof(qd_steps) / sizeof(qd_steps[0]) && !stop; ++i) {
+		ret = qd_step(&run, qd_steps[i], &res);
+		if (ret)
+			break;
+		lsnvme_print_qd(ns, &res, rp);
+	}
+out:
+	if (ret)
+		fprintf(stderr, "%squeue depth sweep failed on: %s: %s\n",
+			TAB, ns->devnode, strerror(ret));
+	uring_exit(&run.ring);
+	close(run.fd);
+	free(run.bufs);
+	free(run.lat);
+}
+
+static int lsnvme_qd_sweep(void)
+{
+	unsigned int i, n;
+
+	catch_stop_signals();
+
+	lsnvme_collect();
+
+	if (opts.format == FMT_TEXT)
+		printf("[dev]\tdev\tqd\tiops\tp50us\tp99us\tp99.9us\tmaxus\t"
+		       "rp\n");
+	for (i = 0; i < nr_ctrls && !stop; ++i)
+		for (n = 0; n < ctrls[i].nr_ns && !stop; ++n)
+			if (!ctrls[i].ns[n].is_part && ctrls[i].ns[n].devnode)
+				lsnvme_qd_sweep_ns(&ctrls[i].ns[n]);
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --admin-stats=N: send N Get Features (Number of Queues) to every
+ * controller, one after the other per controller and controllers in
+ * parallel, to see how responsive the admin queues are under live load.
+ */
+static void lsnvme_admin_loop_one(struct lsnvme_ctrl *ctrl)
+{
+	struct lsnvme_handle *h = lsnvme_dev_get(ctrl->devnum, ctrl->devnode);
+	unsigned int i;
+	uint32_t result;
+
+	for (i = 0; i < opts.admin_loop && !stop; ++i)
+		if (lsnvme_get_features(h, NVME_FEAT_NUM_QUEUES, 0, NULL, 0,
+					&result) && h && h->err)
+			break;
+}
+
+static int lsnvme_admin_loop(void)
+{
+	unsigned int i;
+
+	catch_stop_signals();
+
+	opts.disp_devs = false;
+	lsnvme_collect();
+	lsnvme_for_each_ctrl(lsnvme_admin_loop_one);
+
+	for (i = 0; i < nr_ctrls; ++i)
+		lsnvme_print_admin_stats(&ctrls[i]);
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --errors: the Error Information log holds elpe + 1 entries, newest
+ * first. The error_count of the newest entry printed is kept per
+ * controller, under the Identify cache's serial number and controller ID
+ * key, so the next run reads a single entry to learn the current count and
+ * then only the entries that are new. The cursors go to the cache
+ * directory without turning the Identify cache on; mock controllers have
+ * none.
+ */
+static const char *errors_dir(void)
+{
+	if (transport != &ioctl_transport)
+		return NULL;
+
+	return opts.cache_dir ? opts.cache_dir : "/run/lsnvme";
+}
+
+static bool errors_path(char *buf, size_t len, struct lsnvme_ctrl *ctrl)
+{
+	int off;
+
+	if (!errors_dir() || !cache_ctrl_known(ctrl->sn, ctrl->cntlid))
+		return false;
+
+	off = snprintf(buf, len, "%s/", errors_dir());
+	if (off < 0 || (size_t)off >= len)
+		return false;
+
+	off = cache_key(buf, off, len, ctrl->sn);
+	off += snprintf(buf + off, len - off, "-");
+	off = cache_key(buf, off, len, ctrl->cntlid);
+	return (size_t)snprintf(buf + off, len - off, ".errors") < len - off;
+}
+
+static uint64_t errors_cursor_load(struct lsnvme_ctrl *ctrl)
+{
+	char path[PATH_MAX], buf[32];
+	ssize_t len;
+	int fd;
+
+	if (opts.refresh || !errors_path(path, sizeof(path), ctrl))
+		return 0;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = 0;
+
+	return strtoull(buf, NULL, 10);
+}
+
+static void errors_cursor_store(struct lsnvme_ctrl *ctrl, uint64_t count)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 16], buf[32];
+	bool ok;
+	int fd, len;
+
+	if (!errors_path(path, sizeof(path), ctrl))
+		return;
+
+	if (mkdir(errors_dir(), 0755) < 0 && errno != EEXIST)
+		return;
+
+	fd = cache_tmp(tmp, sizeof(tmp), path);
+	if (fd < 0)
+		return;
+
+	len = snprintf(buf, sizeof(buf), "%"PRIu64"\n", count);
+	ok = write(fd, buf, len) == len;
+	close(fd);
+
+	if (!ok || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+static void lsnvme_errors_one(struct lsnvme_ctrl *ctrl)
+{
+	struct lsnvme_handle *h = lsnvme_dev_get(ctrl->devnum, ctrl->devnode);
+	struct nvme_error_log_page newest;
+	uint64_t last, nr, max;
+	unsigned int i;
+
+	lsnvme_identify_ctrl_one(ctrl);
+	if (ctrl->id_ret) {
+		ctrl->err_ret = ctrl->id_ret;
+		return;
+	}
+	max = ctrl->id->elpe + 1;
+
+	ctrl->err_ret = lsnvme_get_log(h, 0xffffffff, NVME_LOG_ERROR,
+				       &newest, sizeof(newest));
+	if (ctrl->err_ret)
+		return;
+
+	ctrl->err_count = le64toh(newest.error_count);
+	last = errors_cursor_load(ctrl);
+	if (last > ctrl->err_count)	/* reset, e.g. after a format */
+		last = 0;
+
+	nr = ctrl->err_count - last;
+	if (nr > max) {
+		ctrl->err_lost = nr - max;
+		nr = max;
+	}
+	if (!nr)
+		return;
+
+	ctrl->errs = malloc(nr * sizeof(*ctrl->errs));
+	if (!ctrl->errs) {
+		ctrl->err_ret = ENOMEM;
+		return;
+	}
+
+	if (nr == 1)
+		ctrl->errs[0] = newest;
+	else
+		ctrl->err_ret = lsnvme_get_log(h, 0xffffffff, NVME_LOG_ERROR,
+					       ctrl->errs,
+					       nr * sizeof(*ctrl->errs));
+	if (ctrl->err_ret)
+		return;
+
+	/* unused entries read as zero */
+	for (i = 0; i < nr && le64toh(ctrl->errs[i].error_count) > last; ++i)
+		;
+	ctrl->nr_errs = i;
+}
+
+static void lsnvme_print_errors(struct lsnvme_ctrl *ctrl)
+{
+	struct nvme_error_log_page *e;
+	unsigned int i, sf;
+
+	if (ctrl->err_ret) {
+		fprintf(stderr, "%serror log failed on: %s\n",
+			TAB, ctrl->devnode);
+		return;
+	}
+
+	if (ctrl->err_lost)
+		fprintf(stderr, "%s%"PRIu64" older errors already dropped "
+			"from the log of: %s\n", TAB, ctrl->err_lost,
+			ctrl->devnode);
+
+	for (i = 0; i < ctrl->nr_errs; ++i) {
+		e = &ctrl->errs[i];
+		/* bit 0 is the phase tag */
+		sf = le16toh(e->status_field) >> 1;
+
+		if (opts.format != FMT_TEXT) {
+			struct out_field f[] = {
+				f_num("ctrl", ctrl->sysnum),
+				F_STR("dev", ctrl->devnode),
+				F_U64("error_count", le64toh(e->error_count)),
+				F_U64("sqid", le16toh(e->sqid)),
+				F_U64("cmdid", le16toh(e->cmdid)),
+				F_U64("sct", sf >> 8 & 0x7),
+				F_U64("sc", sf & 0xff),
+				F_U64("dnr", sf >> 14 & 1),
+				F_U64("parm_loc",
+				      le16toh(e->parm_error_location)),
+				F_U64("lba", le64toh(e->lba)),
+				F_U64("nsid", le32toh(e->nsid)),
+			};
+
+			out_record("error", f, sizeof(f) / sizeof(f[0]));
+			continue;
+		}
+
+		printf("[%s]\t%s\t%"PRIu64"\t%u\t0x%04x\t%x/%02x%s\t"
+		       "%"PRIu64"\t%u\n",
+			ctrl->sysnum, ctrl->devnode,
+			(uint64_t)le64toh(e->error_count), le16toh(e->sqid),
+			le16toh(e->cmdid), sf >> 8 & 0x7, sf & 0xff,
+			sf >> 14 & 1 ? " dnr" : "",
+			(uint64_t)le64toh(e->lba), le32toh(e->nsid));
+	}
+}
+
+static int lsnvme_errors(void)
+{
+	unsigned int i;
+
+	opts.disp_devs = false;
+	lsnvme_collect();
+	lsnvme_for_each_ctrl(lsnvme_errors_one);
+
+	if (opts.format == FMT_TEXT)
+		printf("[dev]\tdev\tcount\tsqid\tcmdid\tsct/sc\tlba\tnsid\n");
+	for (i = 0; i < nr_ctrls; ++i) {
+		lsnvme_print_errors(&ctrls[i]);
+		if (!ctrls[i].err_ret)
+			errors_cursor_store(&ctrls[i], ctrls[i].err_count);
+	}
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --firmware: the Firmware Slot log of every controller, read in
+ * parallel. The default view lists the running and the staged revision of
+ * each controller, "rollup" counts controllers per model and running
+ * revision so hosts can be merged into a fleet-wide answer.
+ */
+enum {
+	FW_SLOTS,
+	FW_ROLLUP,
+};
+
+struct fw_group {
+	const char *model;
+	char rev[9];
+	unsigned int count;
+	unsigned int pending;	/* with an image activated at next reset */
+};
+
+/* a revision from a fixed width, space padded field */
+static void fw_rev(char *buf, const void *fr)
+{
+	size_t len = 8;
+
+	memcpy(buf, fr, len);
+	while (len > 0 && (buf[len - 1] == ' ' || buf[len - 1] == 0))
+		--len;
+	buf[len] = 0;
+}
+
+static void lsnvme_firmware_one(struct lsnvme_ctrl *ctrl)
+{
+	struct lsnvme_handle *h = lsnvme_dev_get(ctrl->devnum, ctrl->devnode);
+
+	/* Model Number and the number of slots */
+	lsnvme_identify_ctrl_one(ctrl);
+
+	ctrl->fw = malloc(sizeof(*ctrl->fw));
+	if (!ctrl->fw) {
+		ctrl->fw_ret = ENOMEM;
+		return;
+	}
+
+	ctrl->fw_ret = lsnvme_get_log(h, 0xffffffff, NVME_LOG_FW_SLOT,
+				      ctrl->fw, sizeof(*ctrl->fw));
+}
+
+static unsigned int fw_nr_slots(struct lsnvme_ctrl *ctrl)
+{
+	unsigned int nr = ctrl->id_ret ? 7 : ctrl->id->frmw >> 1 & 0x7;
+
+	return nr ? nr : 7;
+}
+
+static const char *fw_model(struct lsnvme_ctrl *ctrl, char *buf, size_t len)
+{
+	size_t n;
+
+	if (ctrl->id_ret)
+		return ctrl->mn;
+
+	n = sizeof(ctrl->id->mn) < len - 1 ? sizeof(ctrl->id->mn) : len - 1;
+	memcpy(buf, ctrl->id->mn, n);
+	while (n > 0 && (buf[n - 1] == ' ' || buf[n - 1] == 0))
+		--n;
+	buf[n] = 0;
+
+	return buf;
+}
+
+/* running and next-reset slot, 0 if none; rev buffers hold 9 bytes */
+static unsigned int fw_active(struct lsnvme_ctrl *ctrl, char *rev)
+{
+	unsigned int slot = ctrl->fw->afi & 0x7;
+
+	if (!slot || slot > 7) {
+		/* fall back to what the driver saw at probe time */
+		snprintf(rev, 9, "%s", ctrl->fr ? ctrl->fr : "-");
+		return 0;
+	}
+
+	fw_rev(rev, &ctrl->fw->frs[slot - 1]);
+	return slot;
+}
+
+static unsigned int fw_pending(struct lsnvme_ctrl *ctrl, char *rev)
+{
+	unsigned int slot = ctrl->fw->afi >> 4 & 0x7;
+
+	if (!slot)
+		return 0;
+
+	fw_rev(rev, &ctrl->fw->frs[slot - 1]);
+	return slot;
+}
+
+static void lsnvme_print_firmware(struct lsnvme_ctrl *ctrl)
+{
+	char model[41], active[9], pending[9], frs[7][9];
+	unsigned int i, nr, act, pend;
+
+	if (ctrl->fw_ret) {
+		fprintf(stderr, "%sfirmware log failed on: %s\n",
+			TAB, ctrl->devnode);
+		return;
+	}
+
+	nr = fw_nr_slots(ctrl);
+	act = fw_active(ctrl, active);
+	pend = fw_pending(ctrl, pending);
+	for (i = 0; i < 7; ++i)
+		fw_rev(frs[i], &ctrl->fw->frs[i]);
+
+	if (opts.format != FMT_TEXT) {
+		static const char *keys[] = {
+			"slot1", "slot2", "slot3", "slot4",
+			"slot5", "slot6", "slot7",
+		};
+		struct out_field f[16];
+		unsigned int n = 0;
+
+		f[n++] = f_num("ctrl", ctrl->sysnum);
+		f[n++] = (struct out_field)F_STR("dev", ctrl->devnode);
+		f[n++] = (struct out_field)F_STR("model",
+					fw_model(ctrl, model, sizeof(model)));
+		f[n++] = (struct out_field)F_U64("active_slot", act);
+		f[n++] = (struct out_field)F_STR("active", active);
+		if (pend) {
+			f[n++] = (struct out_field)F_U64("pending_slot", pend);
+			f[n++] = (struct out_field)F_STR("pending", pending);
+		} else {
+			f[n++] = (struct out_field)F_NULL("pending_slot");
+			f[n++] = (struct out_field)F_NULL("pending");
+		}
+		for (i = 0; i < 7; ++i)
+			f[n++] = (struct out_field)F_STR(keys[i],
+					i < nr && *frs[i] ? frs[i] : NULL);
+
+		out_record("firmware", f, n);
+		return;
+	}
+
+	printf("[%s]\t%s\t%s\t%s\t%s\t", ctrl->sysnum, ctrl->devnode,
+		fw_model(ctrl, model, sizeof(model)), active,
+		pend ? pending : "-");
+	for (i = 0; i < nr; ++i)
+		printf("%s%u:%s", i ? " " : "", i + 1, *frs[i] ? frs[i] : "-");
+	printf("\n");
+}
+
+static int fw_group_cmp(const void *a, const void *b)
+{
+	const struct fw_group *x = a, *y = b;
+	int ret = strcmp(x->model, y->model);
+
+	return ret ? ret : strcmp(x->rev, y->rev);
+}
+
+static void lsnvme_print_fw_rollup(void)
+{
+	struct fw_group *groups = NULL;
+	char (*models)[41];
+	char rev[9], pending[9];
+	unsigned int i, j, nr = 0;
+
+	models = calloc(nr_ctrls ? nr_ctrls : 1, sizeof(*models));
+	groups = calloc(nr_ctrls ? nr_ctrls : 1, sizeof(*groups));
+	if (!models || !groups) {
+		free(models);
+		free(groups);
+		return;
+	}
+
+	for (i = 0; i < nr_ctrls; ++i) {
+		struct lsnvme_ctrl *ctrl = &ctrls[i];
+		const char *model;
+
+		if (ctrl->fw_ret) {
+			fprintf(stderr, "%sfirmware log failed on: %s\n",
+				TAB, ctrl->devnode);
+			continue;
+		}
+
+		model = fw_model(ctrl, models[i], sizeof(models[i]));
+		fw_active(ctrl, rev);
+		for (j = 0; j < nr; ++j)
+			if (!strcmp(groups[j].model, model) &&
+			    !strcmp(groups[j].rev, rev))
+				break;
+		if (j == nr) {
+			groups[nr].model = model;
+			memcpy(groups[nr].rev, rev, sizeof(rev));
+			++nr;
+		}
+		groups[j].count++;
+		if (fw_pending(ctrl, pending))
+			groups[j].pending++;
+	}
+
+	qsort(groups, nr, sizeof(*groups), fw_group_cmp);
+
+	if (opts.format == FMT_TEXT)
+		printf("count\tpending\tmodel\trevision\n");
+	for (i = 0; i < nr; ++i) {
+		if (opts.format != FMT_TEXT) {
+			struct out_field f[] = {
+				F_STR("model", groups[i].model),
+				F_STR("revision", groups[i].rev),
+				F_U64("count", groups[i].count),
+				F_U64("pending", groups[i].pending),
+			};
+
+			out_record("firmware_rollup", f,
+				   sizeof(f) / sizeof(f[0]));
+			continue;
+		}
+
+		printf("%u\t%u\t%s\t%s\n", groups[i].count,
+			groups[i].pending, groups[i].model, groups[i].rev);
+	}
+
+	out_flush();
+	free(groups);
+	free(models);
+}
+
+static int lsnvme_firmware(void)
+{
+	unsigned int i;
+
+	opts.disp_devs = false;
+	lsnvme_collect();
+	lsnvme_for_each_ctrl(lsnvme_firmware_one);
+
+	if (opts.firmware == FW_ROLLUP) {
+		lsnvme_print_fw_rollup();
+	} else {
+		if (opts.format == FMT_TEXT)
+			printf("[dev]\tdev\tmodel\tactive\tpending\tslots\n");
+		for (i = 0; i < nr_ctrls; ++i)
+			lsnvme_print_firmware(&ctrls[i]);
+	}
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --power: the power state descriptors of Identify Controller, the
+ * current state and the Autonomous Power State Transition table. Any
+ * state APST may drop an idle controller into can be entered right before
+ * the next command arrives, so its entry plus exit latency is added to
+ * that command.
+ */
+#define APST_SLOW_US	1000
+
+static void lsnvme_power_one(struct lsnvme_ctrl *ctrl)
+{
+	struct lsnvme_handle *h = lsnvme_dev_get(ctrl->devnum, ctrl->devnode);
+	uint32_t result;
+
+	lsnvme_identify_ctrl_one(ctrl);
+	if (ctrl->id_ret) {
+		ctrl->pm_ret = ctrl->apst_ret = ctrl->id_ret;
+		return;
+	}
+
+	ctrl->pm_ret = lsnvme_get_features(h, NVME_FEAT_POWER_MGMT, 0, NULL,
+					   0, &ctrl->ps);
+	ctrl->ps &= 0x1f;
+
+	if (!(ctrl->id->apsta & 1))
+		return;
+
+	ctrl->apst = calloc(32, sizeof(*ctrl->apst));
+	if (!ctrl->apst) {
+		ctrl->apst_ret = ENOMEM;
+		return;
+	}
+
+	ctrl->apst_ret = lsnvme_get_features(h, NVME_FEAT_AUTO_PST, 0,
+					     ctrl->apst,
+					     32 * sizeof(*ctrl->apst),
+					     &result);
+	ctrl->apste = !ctrl->apst_ret && (result & 1);
+}
+
+/* ms of idle time before APST leaves state ps, 0 if it never does */
+static uint32_t apst_idle_ms(struct lsnvme_ctrl *ctrl, unsigned int ps,
+			     unsigned int *to)
+{
+	uint32_t data;
+
+	if (!ctrl->apste)
+		return 0;
+
+	data = le32toh(ctrl->apst[ps].data);
+	*to = data >> 3 & 0x1f;
+
+	return data >> 8;
+}
+
+/* worst entry + exit latency of a state APST can put the controller in */
+static uint64_t apst_wake_us(struct lsnvme_ctrl *ctrl)
+{
+	struct nvme_id_power_state *psd;
+	unsigned int ps, to;
+	uint64_t wake = 0, lat;
+
+	for (ps = 0; ps <= ctrl->id->npss && ps < 32; ++ps) {
+		if (!apst_idle_ms(ctrl, ps, &to) || to > ctrl->id->npss)
+			continue;
+
+		psd = &ctrl->id->psd[to];
+		lat = (uint64_t)le32toh(psd->entry_lat) +
+		      le32toh(psd->exit_lat);
+		if (lat > wake)
+			wake = lat;
+	}
+
+	return wake;
+}
+
+/* max_power is in centiwatts, or 0.0001 W units with MPS set */
+static double psd_watts(struct nvme_id_power_state *psd)
+{
+	double scale = psd->flags & NVME_PS_FLAGS_MAX_POWER_SCALE ?
+		       0.0001 : 0.01;
+
+	return le16toh(psd->max_power) * scale;
+}
+
+static void lsnvme_print_psd(struct lsnvme_ctrl *ctrl, unsigned int ps)
+{
+	struct nvme_id_power_state *psd = &ctrl->id->psd[ps];
+	bool non_op = psd->flags & NVME_PS_FLAGS_NON_OP_STATE;
+	uint32_t idle;
+	unsigned int to = 0;
+
+	idle = apst_idle_ms(ctrl, ps, &to);
+
+	if (opts.format != FMT_TEXT) {
+		struct out_field f[] = {
+			f_num("ctrl", ctrl->sysnum),
+			F_STR("dev", ctrl->devnode),
+			F_U64("ps", ps),
+			F_DBL("max_power_w", psd_watts(psd)),
+			F_U64("non_op", non_op),
+			F_U64("entry_lat_us", le32toh(psd->entry_lat)),
+			F_U64("exit_lat_us", le32toh(psd->exit_lat)),
+			F_U64("rrt", psd->read_tput & 0x1f),
+			F_U64("rrl", psd->read_lat & 0x1f),
+			F_U64("rwt", psd->write_tput & 0x1f),
+			F_U64("rwl", psd->write_lat & 0x1f),
+			idle ? (struct out_field)F_U64("apst_idle_ms", idle) :
+			       (struct out_field)F_NULL("apst_idle_ms"),
+			idle ? (struct out_field)F_U64("apst_to", to) :
+			       (struct out_field)F_NULL("apst_to"),
+		};
+
+		out_record("power_state", f, sizeof(f) / sizeof(f[0]));
+		return;
+	}
+
+	printf("%s%sps%u\t%.4gW\t%u\t%u\t%u/%u/%u/%u\t%s",
+		TAB, !ctrl->pm_ret && ps == ctrl->ps ? "*" : "", ps,
+		psd_watts(psd),
+		le32toh(psd->entry_lat), le32toh(psd->exit_lat),
+		psd->read_tput & 0x1f, psd->read_lat & 0x1f,
+		psd->write_tput & 0x1f, psd->write_lat & 0x1f,
+		non_op ? "non-op" : "op");
+	if (idle)
+		printf("\tps%u after %ums", to, idle);
+	printf("\n");
+}
+
+static void lsnvme_print_power(struct lsnvme_ctrl *ctrl)
+{
+	uint64_t wake;
+	bool slow;
+	unsigned int ps;
+
+	if (ctrl->id_ret) {
+		fprintf(stderr, "%sidentify failed on: %s\n",
+			TAB, ctrl->devnode);
+		return;
+	}
+	if (ctrl->apst_ret)
+		fprintf(stderr, "%sAPST feature failed on: %s\n",
+			TAB, ctrl->devnode);
+
+	wake = apst_wake_us(ctrl);
+	slow = wake >= APST_SLOW_US;
+
+	if (opts.format != FMT_TEXT) {
+		struct out_field f[] = {
+			f_num("ctrl", ctrl->sysnum),
+			F_STR("dev", ctrl->devnode),
+			ctrl->pm_ret ? (struct out_field)F_NULL("ps") :
+				       (struct out_field)F_U64("ps", ctrl->ps),
+			F_U64("npss", ctrl->id->npss),
+			F_U64("apsta", ctrl->id->apsta & 1),
+			F_U64("apste", ctrl->apste),
+			F_U64("wake_us", wake),
+			F_U64("slow_wake", slow),
+		};
+
+		out_record("power", f, sizeof(f) / sizeof(f[0]));
+	} else {
+		printf("[%s]\t%s\t", ctrl->sysnum, ctrl->devnode);
+		if (ctrl->pm_ret)
+			printf("-");
+		else
+			printf("ps%u", ctrl->ps);
+		printf("\t%s\t%"PRIu64"%s\n",
+			!(ctrl->id->apsta & 1) ? "unsupported" :
+			ctrl->apste ? "on" : "off", wake,
+			slow ? "\tslow-wake" : "");
+	}
+
+	for (ps = 0; ps <= ctrl->id->npss && ps < 32; ++ps)
+		lsnvme_print_psd(ctrl, ps);
+}
+
+static int lsnvme_power(void)
+{
+	unsigned int i;
+
+	opts.disp_devs = false;
+	lsnvme_collect();
+	lsnvme_for_each_ctrl(lsnvme_power_one);
+
+	if (opts.format == FMT_TEXT)
+		printf("[dev]\tdev\tps\tapst\twake_us\n"
+		       "%sps\tmax\tentry_us\texit_us\trt/rl/wt/wl\n", TAB);
+	for (i = 0; i < nr_ctrls; ++i)
+		lsnvme_print_power(&ctrls[i]);
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --lbaf: every LBA format a namespace supports with its Relative
+ * Performance, the one in use (FLBAS bits 3:0), and whether a format
+ * rated faster is available. Changing it takes a Format NVM, which is
+ * left to the operator.
+ */
+static const char *lbaf_rp_str[] = { "best", "better", "good", "degraded" };
+
+/* ties go to the active format, then to one with the same metadata size */
+static unsigned int lbaf_rank(struct nvme_id_ns *id, unsigned int i)
+{
+	unsigned int cur = id->flbas & 0xf;
+
+	return (id->lbaf[i].rp & 3) << 2 |
+	       (id->lbaf[i].ms != id->lbaf[cur].ms) << 1 | (i != cur);
+}
+
+/* fastest supported format */
+static unsigned int lbaf_best(struct nvme_id_ns *id)
+{
+	unsigned int i, best = id->flbas & 0xf;
+
+	for (i = 0; i <= id->nlbaf && i < 16; ++i)
+		if (id->lbaf[i].ds && lbaf_rank(id, i) < lbaf_rank(id, best))
+			best = i;
+
+	return best;
+}
+
+static void lsnvme_lbaf_one(struct lsnvme_ctrl *ctrl)
+{
+	unsigned int n;
+
+	for (n = 0; n < ctrl->nr_ns; ++n)
+		if (!ctrl->ns[n].is_part)
+			lsnvme_identify_ns_one(&ctrl->ns[n]);
+}
+
+static void lsnvme_print_lbaf(struct lsnvme_ns *ns)
+{
+	struct nvme_id_ns *id = ns->id;
+	const char *dev = ns->devnode ? ns->devnode : "-";
+	unsigned int i, cur, best;
+	bool slow;
+
+	if (ns->id_ret) {
+		fprintf(stderr, "%sidentify failed on: %s\n", TAB, dev);
+		return;
+	}
+
+	cur = id->flbas & 0xf;
+	best = lbaf_best(id);
+	slow = (id->lbaf[best].rp & 3) < (id->lbaf[cur].rp & 3);
+
+	if (opts.format != FMT_TEXT) {
+		struct out_field f[] = {
+			f_num("ctrl", ns->ctrl_sysnum),
+			f_num("ns", ns->sysnum),
+			F_U64("nsid", ns->nsid),
+			F_STR("dev", ns->devnode),
+			F_U64("nlbaf", id->nlbaf + 1),
+			F_U64("active", cur),
+			F_U64("best", best),
+			F_U64("slower", slow),
+		};
+
+		out_record("lbaf_ns", f, sizeof(f) / sizeof(f[0]));
+	} else {
+		printf("[%s:%s]\t%s\t%u\tlbaf%u\tlbaf%u%s\n",
+			ns->ctrl_sysnum, ns->sysnum ? ns->sysnum : "-", dev,
+			ns->nsid, cur, best, slow ? "\tslower" : "");
+	}
+
+	for (i = 0; i <= id->nlbaf && i < 16; ++i) {
+		struct nvme_lbaf *l = &id->lbaf[i];
+
+		if (opts.format != FMT_TEXT) {
+			struct out_field f[] = {
+				f_num("ctrl", ns->ctrl_sysnum),
+				F_U64("nsid", ns->nsid),
+				F_U64("lbaf", i),
+				F_U64("lba_size", l->ds ? 1ULL << l->ds : 0),
+				F_U64("ms", le16toh(l->ms)),
+				F_STR("rp", lbaf_rp_str[l->rp & 3]),
+				F_U64("in_use", i == cur),
+			};
+
+			out_record("lbaf", f, sizeof(f) / sizeof(f[0]));
+			continue;
+		}
+
+		printf("%s%slbaf%u\t%llu\t%u\t%s\n", TAB, i == cur ? "*" : "",
+			i, l->ds ? 1ULL << l->ds : 0ULL, le16toh(l->ms),
+			lbaf_rp_str[l->rp & 3]);
+	}
+}
+
+static int lsnvme_lbaf(void)
+{
+	unsigned int i, n;
+
+	lsnvme_collect();
+	lsnvme_for_each_ctrl(lsnvme_lbaf_one);
+
+	if (opts.format == FMT_TEXT)
+		printf("[dev]\tdev\tnsid\tactive\tbest\n"
+		       "%slbaf\tlba_size\tms\trp\n", TAB);
+	for (i = 0; i < nr_ctrls; ++i)
+		for (n = 0; n < ctrls[i].nr_ns; ++n)
+			if (!ctrls[i].ns[n].is_part)
+				lsnvme_print_lbaf(&ctrls[i].ns[n]);
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --topology: where the I/O queues of a controller run. The controller's
+ * NUMA node and local CPUs come from its PCI device, the CPUs mapped to
+ * each hardware context from <block>/mq/N/cpu_list and the CPUs an
+ * interrupt is delivered to from /proc/irq/N. All namespaces of a
+ * controller share its tag set, so the first one with a block device
+ * stands for all of them. The PCI driver keeps MSI-X vector 0 for the
+ * admin queue and gives I/O queue N (hardware context N - 1) vector N;
+ * msi_irqs lists the vectors in allocation order. An interrupt is remote
+ * when none of the nodes it is delivered to has a CPU submitting to its
+ * queue; how far the queue's CPUs are from the controller is reported
+ * separately as the largest SLIT distance between their nodes.
+ */
+#define TOPO_CPUS	8192
+#define TOPO_NODES	64
+
+struct cpumask {
+	uint64_t bits[TOPO_CPUS / 64];
+};
+
+static struct cpumask topo_node_cpus[TOPO_NODES];
+static unsigned char topo_node_dist[TOPO_NODES][TOPO_NODES];	/* 0: unknown */
+static unsigned int topo_nr_nodes;
+
+/* "0-3,8,10-11" */
+static bool cpulist_parse(const char *s, struct cpumask *m)
+{
+	unsigned long lo, hi;
+	char *end;
+
+	memset(m, 0, sizeof(*m));
+	if (!s)
+		return false;
+
+	while (*s) {
+		lo = hi = strtoul(s, &end, 10);
+		if (end == s)
+			return false;
+		if (*end == '-')
+			hi = strtoul(end + 1, &end, 10);
+		for (; lo <= hi && lo < TOPO_CPUS; ++lo)
+			m->bits[lo / 64] |= 1ULL << (lo % 64);
+		if (*end != ',')
+			break;
+		s = end + 1;
+	}
+
+	return true;
+}
+
+static bool cpumask_intersects(const struct cpumask *a,
+			       const struct cpumask *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < TOPO_CPUS / 64; ++i)
+		if (a->bits[i] & b->bits[i])
+			return true;
+
+	return false;
+}
+
+/* "10 21 ...", the distances of node n to every node */
+static void topo_read_dist(unsigned int n, const char *s)
+{
+	unsigned int i;
+	unsigned long d;
+	char *end;
+
+	for (i = 0; s && i < TOPO_NODES; ++i, s = end) {
+		d = strtoul(s, &end, 10);
+		if (end == s)
+			break;
+		topo_node_dist[n][i] = d < 256 ? d : 255;
+	}
+}
+
+static void topo_read_nodes(void)
+{
+	char path[PATH_MAX], buf[4096];
+	unsigned int n;
+
+	for (n = 0; n < TOPO_NODES; ++n) {
+		snprintf(path, sizeof(path),
+			 "%s/devices/system/node/node%u/cpulist", SYS, n);
+		if (!cpulist_parse(sysfs_read(AT_FDCWD, path, buf, sizeof(buf)),
+				   &topo_node_cpus[n]))
+			continue;
+		topo_nr_nodes = n + 1;
+
+		snprintf(path, sizeof(path),
+			 "%s/devices/system/node/node%u/distance", SYS, n);
+		topo_read_dist(n, sysfs_read(AT_FDCWD, path, buf, sizeof(buf)));
+	}
+}
+
+/*
+ * The NUMA nodes with CPUs in m as a bitmask, and comma separated in buf,
+ * "-" if unknown.
+ */
+static uint64_t topo_nodes(const struct cpumask *m, char *buf, size_t len)
+{
+	uint64_t nodes = 0;
+	unsigned int n;
+	size_t off = 0;
+
+	buf[0] = 0;
+	for (n = 0; n < topo_nr_nodes; ++n) {
+		if (!cpumask_intersects(m, &topo_node_cpus[n]))
+			continue;
+		nodes |= 1ULL << n;
+		if (off < len)
+			off += snprintf(buf + off, len - off, "%s%u",
+					off ? "," : "", n);
+	}
+	if (!off)
+		snprintf(buf, len, "-");
+
+	return nodes;
+}
+
+/* the largest distance from node to any of nodes, 0 if unknown */
+static unsigned int topo_distance(int node, uint64_t nodes)
+{
+	unsigned int n, d = 0;
+
+	if (node < 0 || node >= TOPO_NODES)
+		return 0;
+
+	for (n = 0; n < topo_nr_nodes; ++n) {
+		if (!(nodes & 1ULL << n))
+			continue;
+		if (!topo_node_dist[node][n])
+			return 0;
+		if (topo_node_dist[node][n] > d)
+			d = topo_node_dist[node][n];
+	}
+
+	return d;
+}
+
+static int uint_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+struct uint_list {
+	unsigned int *v;
+	unsigned int nr;
+};
+
+static void uint_list_add(int dirfd, const char *name, void *arg)
+{
+	struct uint_list *l = arg;
+	unsigned int *v;
+
+	(void)dirfd;
+	if (!isdigit((unsigned char)*name))
+		return;
+
+	v = array_grow(l->v, l->nr, sizeof(*l->v));
+	if (!v)
+		return;
+	l->v = v;
+	l->v[l->nr++] = strtoul(name, NULL, 10);
+}
+
+/* the numeric entries of a directory, sorted */
+static void topo_list_dir(const char *path, struct uint_list *l)
+{
+	int fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+	l->v = NULL;
+	l->nr = 0;
+	if (fd < 0)
+		return;
+
+	sysfs_for_each(fd, "", uint_list_add, l);
+	close(fd);
+	qsort(l->v, l->nr, sizeof(*l->v), uint_cmp);
+}
+
+static char *topo_irq_cpus(unsigned int irq, char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	char *p;
+
+	snprintf(path, sizeof(path), "%s/irq/%u/effective_affinity_list",
+		 PROC, irq);
+	p = sysfs_read(AT_FDCWD, path, buf, len);
+	if (p && *p)
+		return p;
+
+	snprintf(path, sizeof(path), "%s/irq/%u/smp_affinity_list", PROC, irq);
+	return sysfs_read(AT_FDCWD, path, buf, len);
+}
+
+static void lsnvme_topology_ctrl(struct lsnvme_ctrl *ctrl)
+{
+	char path[PATH_MAX], numa[16], local[4096], cpus[4096], irq_cpus[4096];
+	char cpu_nodes[256], irq_nodes[256];
+	struct uint_list irqs, hctx;
+	struct lsnvme_ns *ns = NULL;
+	unsigned int i, irq, dist;
+	uint64_t cpu_set, irq_set;
+	struct cpumask m;
+	bool remote;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "%s/class/nvme/%s/device/numa_node",
+		 SYS, ctrl->sysname);
+	if (sysfs_read(AT_FDCWD, path, numa, sizeof(numa)))
+		node = atoi(numa);
+
+	snprintf(path, sizeof(path), "%s/class/nvme/%s/device/local_cpulist",
+		 SYS, ctrl->sysname);
+	if (!sysfs_read(AT_FDCWD, path, local, sizeof(local)))
+		strcpy(local, "-");
+
+	if (opts.format != FMT_TEXT) {
+		struct out_field f[] = {
+			f_num("ctrl", ctrl->sysnum),
+			F_STR("dev", ctrl->devnode),
+			node >= 0 ? (struct out_field)F_U64("numa_node", node) :
+				    (struct out_field)F_NULL("numa_node"),
+			F_STR("local_cpus", local),
+		};
+
+		out_record("topology", f, sizeof(f) / sizeof(f[0]));
+	} else {
+		printf("[%s]\t%s\t", ctrl->sysnum, ctrl->devnode);
+		if (node >= 0)
+			printf("%d", node);
+		else
+			printf("-");
+		printf("\t%s\n", local);
+	}
+
+	snprintf(path, sizeof(path), "%s/class/nvme/%s/device/msi_irqs",
+		 SYS, ctrl->sysname);
+	topo_list_dir(path, &irqs);
+
+	for (i = 0; i < ctrl->nr_ns && !ns; ++i)
+		if (!ctrl->ns[i].is_part && ctrl->ns[i].sysname)
+			ns = &ctrl->ns[i];
+	hctx.v = NULL;
+	hctx.nr = 0;
+	if (ns) {
+		snprintf(path, sizeof(path), "%s/block/%s/mq", SYS, ns->sysname);
+		topo_list_dir(path, &hctx);
+	}
+
+	for (i = 0; i < hctx.nr; ++i) {
+		snprintf(path, sizeof(path), "%s/block/%s/mq/%u/cpu_list",
+			 SYS, ns->sysname, hctx.v[i]);
+		if (!sysfs_read(AT_FDCWD, path, cpus, sizeof(cpus)))
+			strcpy(cpus, "-");
+		cpulist_parse(cpus, &m);
+		cpu_set = topo_nodes(&m, cpu_nodes, sizeof(cpu_nodes));
+		dist = topo_distance(node, cpu_set);
+
+		irq = hctx.v[i] + 1 < irqs.nr ? irqs.v[hctx.v[i] + 1] : 0;
+		if (!irq || !topo_irq_cpus(irq, irq_cpus, sizeof(irq_cpus)))
+			strcpy(irq_cpus, "-");
+		cpulist_parse(irq_cpus, &m);
+		irq_set = topo_nodes(&m, irq_nodes, sizeof(irq_nodes));
+		remote = irq && cpu_set && irq_set && !(cpu_set & irq_set);
+
+		if (opts.format != FMT_TEXT) {
+			struct out_field f[] = {
+				f_num("ctrl", ctrl->sysnum),
+				F_STR("dev", ns->devnode),
+				F_U64("hctx", hctx.v[i]),
+				F_STR("cpus", cpus),
+				F_STR("cpu_nodes", cpu_nodes),
+				dist ? (struct out_field)F_U64("distance", dist) :
+				       (struct out_field)F_NULL("distance"),
+				irq ? (struct out_field)F_U64("irq", irq) :
+				      (struct out_field)F_NULL("irq"),
+				F_STR("irq_cpus", irq_cpus),
+				F_STR("irq_nodes", irq_nodes),
+				F_U64("remote", remote),
+			};
+
+			out_record("hctx", f, sizeof(f) / sizeof(f[0]));
+			continue;
+		}
+
+		printf("%s%u\t%s\t%s\t", TAB, hctx.v[i], cpus, cpu_nodes);
+		if (dist)
+			printf("%u\t", dist);
+		else
+			printf("-\t");
+		if (irq)
+			printf("%u", irq);
+		else
+			printf("-");
+		printf("\t%s\t%s%s\n", irq_cpus, irq_nodes,
+			remote ? "\tremote-irq" : "");
+	}
+
+	free(irqs.v);
+	free(hctx.v);
+}
+
+static int lsnvme_topology(void)
+{
+	unsigned int i;
+
+	lsnvme_collect();
+	topo_read_nodes();
+
+	if (opts.format == FMT_TEXT)
+		printf("[dev]\tdev\tnuma\tlocal_cpus\n"
+		       "%shctx\tcpus\tnodes\tdistance\tirq\tirq_cpus\t"
+		       "irq_nodes\n", TAB);
+	for (i = 0; i < nr_ctrls; ++i)
+		lsnvme_topology_ctrl(&ctrls[i]);
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --hctx: how traffic is spread over the blk-mq hardware contexts of each
+ * namespace. Per-context counters live in debugfs, block/<disk>/hctxN:
+ * queued (requests inserted), run (queue runs), dispatched (a histogram
+ * of requests per dispatch, the last bucket open ended), busy (one line
+ * per request in flight) and io_poll. Old kernels kept queued, run and
+ * dispatched in the mq/N sysfs directory, which is used as a fallback.
+ * Linux 5.16 dropped queued, run, dispatched and io_poll altogether; for
+ * namespaces without them, busy is sampled HCTX_SAMPLES times instead and
+ * the requests seen in flight stand in for the queued count. A context is
+ * hot when it took half again as much as the mean, ignoring namespaces
+ * that have seen too little traffic to tell.
+ */
+#define HCTX_HOT	1.5
+#define HCTX_MIN_QUEUED	1000
+#define HCTX_MIN_SEEN	20
+#define HCTX_SAMPLES	20
+#define HCTX_PERIOD	0.05	/* seconds between samples */
+struct hctx_stat {
+	unsigned int nr;
+	char cpus[256];
+	char dbg[PATH_MAX];	/* debugfs directory, "" if none */
+	int64_t queued, run, dispatched, busy, polled;	/* -1 if unknown */
+	int64_t seen;		/* sum of sampled busy, -1 if not sampled */
+};
+
+struct hctx_ns {
+	struct lsnvme_ns *ns;
+	struct hctx_stat *h;
+	unsigned int nr;
+	const char *basis;	/* "queued", "inflight" or NULL: none */
+	bool sample;		/* no queued counters */
+};
+
+/* a single number, or with key, "key=N" / "key N" out of a list */
+static int64_t hctx_read(const char *dir, const char *name, const char *key)
+{
+	char path[PATH_MAX + 16], buf[4096], *p;
+	size_t len = key ? strlen(key) : 0;
+
+	if (!dir)
+		return -1;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (!sysfs_read(AT_FDCWD, path, buf, sizeof(buf)))
+		return -1;
+	if (!key)
+		return isdigit((unsigned char)*buf) ?
+		       (int64_t)strtoull(buf, NULL, 10) : -1;
+
+	for (p = buf; p; p = strchr(p, '\n'), p = p ? p + 1 : NULL)
+		if (strncmp(p, key, len) == 0 &&
+		    (p[len] == '=' || p[len] == ' '))
+			return strtoull(p + len + 1, NULL, 10);
+
+	return -1;
+}
+
+/* non-empty dispatches, the sum of all but the zero bucket */
+static int64_t hctx_dispatched(const char *dir)
+{
+	char path[PATH_MAX + 16], buf[4096], *p, *end;
+	unsigned long bucket;
+	int64_t sum = 0;
+
+	if (!dir)
+		return -1;
+	snprintf(path, sizeof(path), "%s/dispatched", dir);
+	if (!sysfs_read(AT_FDCWD, path, buf, sizeof(buf)))
+		return -1;
+
+	for (p = buf; *p; p = *end ? end + 1 : end) {
+		bucket = strtoul(p, &end, 10);
+		if (end == p)
+			break;
+		if (*end == '+')
+			++end;
+		if (bucket)
+			sum += strtoull(end, &end, 10);
+		else
+			strtoull(end, &end, 10);
+		end += strcspn(end, "\n");
+	}
+
+	return sum;
+}
+
+static int64_t hctx_busy(const char *dir)
+{
+	char path[PATH_MAX + 16], buf[16384], *p;
+	int64_t nr = 0;
+
+	if (!dir)
+		return -1;
+	snprintf(path, sizeof(path), "%s/busy", dir);
+	if (!sysfs_read(AT_FDCWD, path, buf, sizeof(buf)))
+		return -1;
+
+	for (p = buf; *p; ++p)
+		nr += *p == '\n';
+
+	return *buf ? nr + 1 : 0;
+}
+
+static void hctx_collect(struct lsnvme_ns *ns, unsigned int nr,
+			 struct hctx_stat *h)
+{
+	char mq[PATH_MAX], path[PATH_MAX + 16];
+	const char *d;
+	int fd;
+
+	snprintf(mq, sizeof(mq), "%s/block/%s/mq/%u", SYS, ns->sysname, nr);
+	d = NULL;
+	if (DEBUGFS) {
+		snprintf(h->dbg, sizeof(h->dbg), "%s/block/%s/hctx%u",
+			 DEBUGFS, ns->sysname, nr);
+		fd = open(h->dbg, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (fd >= 0) {
+			close(fd);
+			d = h->dbg;
+		} else {
+			h->dbg[0] = 0;
+		}
+	}
+
+	h->nr = nr;
+	snprintf(path, sizeof(path), "%s/cpu_list", mq);
+	if (!sysfs_read(AT_FDCWD, path, h->cpus, sizeof(h->cpus)))
+		strcpy(h->cpus, "-");
+
+	h->queued = hctx_read(d ? d : mq, "queued", NULL);
+	h->run = hctx_read(d ? d : mq, "run", NULL);
+	h->dispatched = hctx_dispatched(d ? d : mq);
+	h->busy = hctx_busy(d);
+	h->polled = hctx_read(d, "io_poll", "invoked");
+	h->seen = -1;
+}
+
+/* the traffic a context took: queued, or busy samples without it */
+static int64_t hctx_load(const struct hctx_stat *h)
+{
+	return h->seen >= 0 ? h->seen : h->queued;
+}
+
+static struct out_field f_count(const char *key, int64_t v)
+{
+	struct out_field f = F_NULL(key);
+
+	if (v >= 0) {
+		f.type = OUT_U64;
+		f.u = v;
+	}
+	return f;
+}
+
+static void hctx_print_count(int64_t v)
+{
+	if (v >= 0)
+		printf("\t%"PRId64, v);
+	else
+		printf("\t-");
+}
+
+static void lsnvme_print_hctx(struct hctx_ns *hn)
+{
+	struct lsnvme_ns *ns = hn->ns;
+	struct hctx_stat *h = hn->h;
+	unsigned int i, nr = hn->nr;
+	uint64_t total = 0, max = 0;
+	double share, ratio = 0;
+	bool hot, imbalanced;
+	int64_t load;
+
+	for (i = 0; i < nr; ++i) {
+		load = hctx_load(&h[i]);
+		if (load < 0)
+			continue;
+		total += load;
+		if ((uint64_t)load > max)
+			max = load;
+	}
+	if (total)
+		ratio = (double)max * nr / total;
+	imbalanced = nr > 1 && ratio >= HCTX_HOT &&
+		     total >= (hn->sample ? HCTX_MIN_SEEN : HCTX_MIN_QUEUED);
+
+	if (opts.format != FMT_TEXT) {
+		struct out_field f[] = {
+			f_num("ctrl", ns->ctrl_sysnum),
+			f_num("ns", ns->sysnum),
+			F_STR("dev", ns->devnode),
+			F_U64("nr_hctx", nr),
+			hn->basis ? (struct out_field)F_STR("basis", hn->basis) :
+				    (struct out_field)F_NULL("basis"),
+			F_U64("total", total),
+			F_DBL("max_over_mean", ratio),
+			F_U64("imbalanced", imbalanced),
+		};
+
+		out_record("hctx_ns", f, sizeof(f) / sizeof(f[0]));
+	} else {
+		printf("[%s:%s]\t%s\t%u\t%s\t%"PRIu64"\t%.2f%s\n",
+			ns->ctrl_sysnum, ns->sysnum, ns->devnode, nr,
+			hn->basis ? hn->basis : "-", total, ratio,
+			imbalanced ? "\timbalanced" : "");
+	}
+
+	for (i = 0; i < nr; ++i) {
+		load = hctx_load(&h[i]);
+		share = total && load >= 0 ? 100.0 * load / total : 0;
+		hot = imbalanced && share >= HCTX_HOT * 100 / nr;
+
+		if (opts.format != FMT_TEXT) {
+			struct out_field f[] = {
+				f_num("ctrl", ns->ctrl_sysnum),
+				f_num("ns", ns->sysnum),
+				F_U64("hctx", h[i].nr),
+				F_STR("cpus", h[i].cpus),
+				f_count("queued", h[i].queued),
+				F_DBL("share", share),
+				f_count("dispatched", h[i].dispatched),
+				f_count("run", h[i].run),
+				f_count("busy", h[i].busy),
+				f_count("polled", h[i].polled),
+				f_count("seen", h[i].seen),
+				F_U64("hot", hot),
+			};
+
+			out_record("hctx", f, sizeof(f) / sizeof(f[0]));
+			continue;
+		}
+
+		printf("%s%u\t%s", TAB, h[i].nr, h[i].cpus);
+		hctx_print_count(h[i].queued);
+		printf("\t%.1f", share);
+		hctx_print_count(h[i].dispatched);
+		hctx_print_count(h[i].run);
+		hctx_print_count(h[i].busy);
+		hctx_print_count(h[i].polled);
+		hctx_print_count(h[i].seen);
+		printf("%s\n", hot ? "\thot" : "");
+	}
+}
+
+/* false if the namespace has nothing to show */
+static bool lsnvme_hctx_ns(struct lsnvme_ns *ns, struct hctx_ns *hn)
+{
+	struct uint_list l;
+	char path[PATH_MAX];
+	unsigned int i;
+	bool busy = false;
+
+	snprintf(path, sizeof(path), "%s/block/%s/mq", SYS, ns->sysname);
+	topo_list_dir(path, &l);
+	if (!l.nr) {
+		fprintf(stderr, "%sno hardware queues for: %s\n", TAB,
+			ns->devnode);
+		free(l.v);
+		return false;
+	}
+
+	hn->ns = ns;
+	hn->nr = l.nr;
+	hn->h = calloc(l.nr, sizeof(*hn->h));
+	if (hn->h) {
+		hn->sample = true;
+		for (i = 0; i < l.nr; ++i) {
+			hctx_collect(ns, l.v[i], &hn->h[i]);
+			hn->sample &= hn->h[i].queued < 0;
+			busy |= hn->h[i].busy >= 0;
+		}
+	}
+	free(l.v);
+	if (!hn->h)
+		return false;
+
+	if (!hn->sample) {
+		hn->basis = "queued";
+	} else if (!busy) {
+		fprintf(stderr, "%sno per-queue counters for: %s\n", TAB,
+			ns->devnode);
+		hn->sample = false;
+	} else {
+		fprintf(stderr, "%sno queued counters for: %s, sampling "
+			"requests in flight\n", TAB, ns->devnode);
+		hn->basis = "inflight";
+		for (i = 0; i < hn->nr; ++i)
+			hn->h[i].seen = 0;
+	}
+
+	return true;
+}
+
+/* all namespaces at once, so sampling takes the same time for any number */
+static void hctx_sample(struct hctx_ns *hn, unsigned int nr)
+{
+	unsigned int s, i, j;
+	int64_t busy;
+	double t = now();
+
+	for (s = 0; s < HCTX_SAMPLES && !stop; ++s) {
+		for (i = 0; i < nr; ++i) {
+			for (j = 0; hn[i].sample && j < hn[i].nr; ++j) {
+				busy = hctx_busy(hn[i].h[j].dbg[0] ?
+						 hn[i].h[j].dbg : NULL);
+				if (busy > 0)
+					hn[i].h[j].seen += busy;
+			}
+		}
+		t += HCTX_PERIOD;
+		if (s + 1 < HCTX_SAMPLES)
+			sleep_until(t);
+	}
+}
+
+static int lsnvme_hctx(void)
+{
+	struct hctx_ns *hn = NULL, *tmp;
+	unsigned int i, n, nr = 0;
+	bool sample = false;
+
+	catch_stop_signals();
+	lsnvme_collect();
+
+	for (i = 0; i < nr_ctrls; ++i) {
+		for (n = 0; n < ctrls[i].nr_ns; ++n) {
+			if (ctrls[i].ns[n].is_part || !ctrls[i].ns[n].sysname)
+				continue;
+			tmp = array_grow(hn, nr, sizeof(*hn));
+			if (!tmp)
+				break;
+			hn = tmp;
+			if (lsnvme_hctx_ns(&ctrls[i].ns[n], &hn[nr]))
+				sample |= hn[nr++].sample;
+		}
+	}
+	if (sample)
+		hctx_sample(hn, nr);
+
+	if (opts.format == FMT_TEXT)
+		printf("[dev]\tdev\thctxs\tbasis\ttotal\tmax/mean\n"
+		       "%shctx\tcpus\tqueued\tshare%%\tdispatched\trun\tbusy\t"
+		       "polled\tseen\n", TAB);
+	for (i = 0; i < nr; ++i) {
+		lsnvme_print_hctx(&hn[i]);
+		free(hn[i].h);
+	}
+	free(hn);
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * --tuning: every attribute of <block>/queue of each namespace, checked
+ * against a profile. A profile has one rule per line:
+ *
+ *	attr = value	exact match, "@attr" for another attribute's value
+ *	attr >= N	attr <= N
+ *	attr ~		the value most namespaces of this host have
+ *
+ * Selections like "[none] mq-deadline" compare by the bracketed entry.
+ */
+enum {
+	TUNE_EQ,
+	TUNE_GE,
+	TUNE_LE,
+	TUNE_SAME,
+};
+
+struct tune_rule {
+	const char *attr;
+	int op;
+	const char *val;	/* TUNE_SAME: the majority value, once known */
+};
+
+struct tune_attr {
+	const char *key;
+	const char *val;
+};
+
+struct tune_ns {
+	struct lsnvme_ns *ns;
+	struct tune_attr *attrs;
+	unsigned int nr;
+};
+
+static const char *tune_default[] = {
+	"scheduler = none",
+	"nr_requests >= 256",
+	"max_sectors_kb = @max_hw_sectors_kb",
+	"rq_affinity >= 1",
+	"nomerges = 0",
+	"add_random = 0",
+	"rotational = 0",
+	"write_cache ~",
+	"io_poll ~",
+};
+
+static struct tune_rule *tune_rules;
+static unsigned int tune_nr_rules;
+
+static int tune_add_rule(const char *line)
+{
+	char attr[64], op[3], val[256];
+	struct tune_rule *r;
+	int n;
+
+	while (isspace((unsigned char)*line))
+		++line;
+	if (!*line || *line == '#')
+		return 0;
+
+	n = sscanf(line, "%63[^ \t=<>~] %2[=<>~] %255[^\n]", attr, op, val);
+	if (n < 2)
+		return -1;
+
+	r = array_grow(tune_rules, tune_nr_rules, sizeof(*tune_rules));
+	if (!r)
+		return -1;
+	tune_rules = r;
+	r = &tune_rules[tune_nr_rules];
+
+	if (strcmp(op, "=") == 0)
+		r->op = TUNE_EQ;
+	else if (strcmp(op, ">=") == 0)
+		r->op = TUNE_GE;
+	else if (strcmp(op, "<=") == 0)
+		r->op = TUNE_LE;
+	else if (strcmp(op, "~") == 0)
+		r->op = TUNE_SAME;
+	else
+		return -1;
+	if (r->op != TUNE_SAME && n < 3)
+		return -1;
+
+	n = strlen(val);
+	while (n > 0 && isspace((unsigned char)val[n - 1]))
+		val[--n] = 0;
+	r->attr = intern(attr);
+	r->val = r->op == TUNE_SAME ? NULL : intern(val);
+	tune_nr_rules++;
+
+	return 0;
+}
+
+static int tune_load(const char *path)
+{
+	unsigned int i;
+	char *line = NULL;
+	size_t len = 0;
+	int nr = 0, ret = 0;
+	FILE *fp;
+
+	if (!path) {
+		for (i = 0; i < sizeof(tune_default) / sizeof(tune_default[0]);
+		     ++i)
+			tune_add_rule(tune_default[i]);
+		return 0;
+	}
+
+	fp = fopen(path, "re");
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+
+	while (getline(&line, &len, fp) > 0) {
+		++nr;
+		if (tune_add_rule(line) < 0) {
+			fprintf(stderr, "%s:%d: invalid rule\n", path, nr);
+			ret = -1;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	return ret;
+}
+
+static void tune_read_attr(int dirfd, const char *name, void *arg)
+{
+	struct tune_ns *t = arg;
+	struct tune_attr *a;
+	char buf[4096];
+
+	if (*name == '.' || !sysfs_read(dirfd, name, buf, sizeof(buf)))
+		return;
+
+	a = array_grow(t->attrs, t->nr, sizeof(*t->attrs));
+	if (!a)
+		return;
+	t->attrs = a;
+	t->attrs[t->nr].key = intern(name);
+	t->attrs[t->nr].val = intern(buf);
+	t->nr++;
+}
+
+/* the value of an attribute, the selected entry of a selection */
+static const char *tune_get(struct tune_ns *t, const char *key, char *buf,
+			    size_t len)
+{
+	const char *v = NULL, *p, *end;
+	unsigned int i;
+
+	for (i = 0; i < t->nr && !v; ++i)
+		if (strcmp(t->attrs[i].key, key) == 0)
+			v = t->attrs[i].val;
+	if (!v)
+		return NULL;
+
+	p = strchr(v, '[');
+	end = p ? strchr(p, ']') : NULL;
+	if (!end)
+		return v;
+
+	snprintf(buf, len, "%.*s", (int)(end - p - 1), p + 1);
+	return buf;
+}
+
+static int str_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* the most common value of an attribute across namespaces */
+static const char *tune_majority(struct tune_ns *tn, unsigned int nr,
+				 const char *key)
+{
+	char buf[256];
+	const char **v, *best = NULL;
+	unsigned int i, run, best_run = 0, nr_v = 0;
+
+	v = calloc(nr ? nr : 1, sizeof(*v));
+	if (!v)
+		return NULL;
+
+	for (i = 0; i < nr; ++i) {
+		v[nr_v] = intern(tune_get(&tn[i], key, buf, sizeof(buf)));
+		if (v[nr_v])
+			nr_v++;
+	}
+
+	qsort(v, nr_v, sizeof(*v), str_cmp);
+	for (i = 0; i < nr_v; i += run) {
+		for (run = 1; i + run < nr_v && v[i] == v[i + run]; ++run)
+			;
+		if (run > best_run) {
+			best = v[i];
+			best_run = run;
+		}
+	}
+	free(v);
+
+	return best;
+}
+
+static void lsnvme_print_tune(struct tune_ns *t, struct tune_rule *r,
+			      const char *val, const char *want, bool ok)
+{
+	const char *dev = t->ns->devnode ? t->ns->devnode : "-";
 
-	if (opts.sz == SZ_AUTO)
-		opts.sz = find_sz(sectors);
+	if (opts.format != FMT_TEXT) {
+		struct out_field f[] = {
+			f_num("ctrl", t->ns->ctrl_sysnum),
+			f_num("ns", t->ns->sysnum),
+			F_STR("dev", t->ns->devnode),
+			F_STR("attr", r->attr),
+			F_STR("value", val),
+			F_STR("want", want),
+			F_U64("ok", ok),
+		};
 
-	if (opts.sz == SZ_B) {
-		ret = snprintf(size_str, 32, "%llu", sectors);
-	} else {
-		total = (double)(sectors) / disk_sizes[opts.sz].div;
-		ret = snprintf(size_str, 32, "%.2f%c",
-				total, disk_sizes[opts.sz].suffix);
+		out_record("tuning", f, sizeof(f) / sizeof(f[0]));
+		return;
 	}
 
-	if (ret >= 32)
-		return "-";
-
-	return size_str;
+	printf("[%s:%s]\t%s\t%s\t%s\t%s%s\n", t->ns->ctrl_sysnum,
+		t->ns->sysnum, dev, r->attr, val ? val : "-",
+		want ? want : "-", ok ? "" : "\tdeviates");
 }
 
-static int lsnvme_identify_ns(struct udev_device *dev, struct nvme_id_ns *ptr)
+static void lsnvme_tune_check(struct tune_ns *t, struct tune_rule *r)
 {
-	const char *devpath = udev_device_get_devnode(dev);
-	uint32_t ns = atoi(udev_device_get_sysnum(dev));
+	char vbuf[256], wbuf[256];
+	const char *val, *want = r->val;
+	bool ok;
 
-	int fd = open(devpath, O_RDONLY|O_NONBLOCK);
-	if (fd < 0) {
-		perror(devpath);
-		return errno;
+	val = tune_get(t, r->attr, vbuf, sizeof(vbuf));
+
+	switch (r->op) {
+	case TUNE_EQ:
+		if (*r->val == '@')
+			want = tune_get(t, r->val + 1, wbuf, sizeof(wbuf));
+		ok = val && want && strcmp(val, want) == 0;
+		break;
+	case TUNE_GE:
+	case TUNE_LE:
+		snprintf(wbuf, sizeof(wbuf), "%s%s",
+			 r->op == TUNE_GE ? ">=" : "<=", r->val);
+		want = wbuf;
+		ok = val && (r->op == TUNE_GE ?
+			     strtoll(val, NULL, 0) >= strtoll(r->val, NULL, 0) :
+			     strtoll(val, NULL, 0) <= strtoll(r->val, NULL, 0));
+		break;
+	default:
+		ok = !val || !want || strcmp(val, want) == 0;
+		break;
 	}
 
-	struct nvme_admin_cmd cmd = {
-		.opcode = nvme_admin_identify,
-		.nsid = ns,
-		.addr = (uint64_t) ptr,
-		.data_len = 4096,
-		.cdw10 = 0,
-	};
+	/* attributes this kernel does not have are not deviations */
+	if (!val && r->op != TUNE_SAME)
+		ok = true;
 
-	return ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+	if (!ok || opts.verbose)
+		lsnvme_print_tune(t, r, val, want, ok);
 }
 
-static const char *lsnvme_query_hwdb(struct udev_device *dev,
-			       const char *key)
+static int lsnvme_tuning(void)
 {
-	static struct udev_hwdb *hwdb = NULL;
-	struct udev_list_entry *list, *current;
-	const char *value = NULL;
-	const char *modalias = NULL;
+	struct tune_ns *tn = NULL, *t;
+	char path[PATH_MAX];
+	unsigned int i, n, nr = 0;
+	int fd;
 
-	// check if value is cached in dev object
-	value = udev_device_get_property_value(dev, key);
-	if (value)
-		return value;
+	if (tune_load(opts.tune_profile))
+		return EXIT_FAILURE;
 
-	modalias = udev_device_get_property_value(dev, "MODALIAS");
+	lsnvme_collect();
 
-	if (!modalias)
-		return "-";
+	for (i = 0; i < nr_ctrls; ++i)
+		for (n = 0; n < ctrls[i].nr_ns; ++n) {
+			struct lsnvme_ns *ns = &ctrls[i].ns[n];
 
-	if (hwdb == NULL)
-		hwdb = udev_hwdb_new(udev);
-	
-	list = udev_hwdb_get_properties_list_entry(hwdb, modalias, 0);
-	current = udev_list_entry_get_by_name(list, key);
+			if (ns->is_part || !ns->sysname)
+				continue;
 
-	value = udev_list_entry_get_value(current);
+			t = array_grow(tn, nr, sizeof(*tn));
+			if (!t)
+				break;
+			tn = t;
+			t = &tn[nr++];
+			memset(t, 0, sizeof(*t));
+			t->ns = ns;
 
-	return value ? strdup(value) : "-";
-}
+			snprintf(path, sizeof(path), "%s/block/%s/queue",
+				 SYS, ns->sysname);
+			fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+			if (fd < 0)
+				continue;
+			sysfs_for_each(fd, "", tune_read_attr, t);
+			close(fd);
+		}
 
-static int lsnvme_identify_ctrl(struct udev_device *dev,
-				struct nvme_id_ctrl *ptr)
-{
-	const char *devpath = udev_device_get_devnode(dev);
+	for (n = 0; n < tune_nr_rules; ++n)
+		if (tune_rules[n].op == TUNE_SAME)
+			tune_rules[n].val = tune_majority(tn, nr,
+							  tune_rules[n].attr);
 
-	int fd = open(devpath, O_RDONLY|O_NONBLOCK);
-	if (fd < 0) {
-		perror(devpath);
-		return errno;
-	}
+	if (opts.format == FMT_TEXT)
+		printf("[dev]\tdev\tattr\tvalue\twant\n");
+	for (i = 0; i < nr; ++i)
+		for (n = 0; n < tune_nr_rules; ++n)
+			lsnvme_tune_check(&tn[i], &tune_rules[n]);
 
-	struct nvme_admin_cmd cmd = {
-		.opcode = nvme_admin_identify,
-		.addr = (uint64_t) ptr,
-		.data_len = 4096,
-		.cdw10 = 1,
-	};
-	
-	return ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+	for (i = 0; i < nr; ++i)
+		free(tn[i].attrs);
+	free(tn);
+	free(tune_rules);
+
+	lsnvme_free_ctrls();
+	sysfs_close_dirs();
+
+	return EXIT_SUCCESS;
 }
 
-void lsnvme_printctrl_id(struct nvme_id_ctrl *id)
+/*
+ * Watch mode: after the initial listing the model is kept and updated
+ * from udev events. Only the controller or namespace an event is about
+ * is re-read (and re-identified with -v), and each change is printed as
+ * a single line prefixed with the udev action.
+ */
+static void watch_print_ctrl(const char *action, struct lsnvme_ctrl *ctrl)
 {
-	printf("%sPCI Vendor ID: %x\n", TAB, id->vid);
-	printf("%sPCI Subsystem Vendor ID: %x\n", TAB, id->ssvid);
-	printf("%sSerial Number: %.20s\n", TAB, id->sn);
-	printf("%sModel Number: %.20s\n", TAB, id->mn);
-	printf("%sFirmware Revision: %.20s\n", TAB, id->fr);
+	if (opts.format != FMT_TEXT) {
+		out_ctrl(action, ctrl);
+		out_flush();
+		return;
+	}
 
-	printf("%sIEEE OUI Identifier: %02x%02x%02x\n",
-		TAB, id->ieee[2], id->ieee[1], id->ieee[0]);
+	printf("%s\t[%s]\t%s\t%s\t%s\t%s\t%s",
+		action, ctrl->sysnum, ctrl->devnode, ctrl->vendor,
+		ctrl->model, ctrl->subsystem, ctrl->driver);
 
-	printf("%sController ID: %x\n", TAB, id->cntlid);
-	printf("%sVersion: %x\n", TAB, id->ver);
-	printf("%sNumber of Namespaces: %d\n", TAB, id->nn);
+	if (opts.verbose && ctrl->id && !ctrl->id_ret)
+		printf("\tsn=%.20s mn=%.40s fr=%.8s",
+			ctrl->id->sn, ctrl->id->mn, ctrl->id->fr);
+	else if (opts.verbose && ctrl->id)
+		printf("\tioctl failed");
+
+	printf("\n");
+	fflush(stdout);
 }
 
-void lsnvme_printctrl_ns(struct nvme_id_ns *ns)
+static void watch_print_ns(const char *action, struct lsnvme_ns *ns)
 {
-	printf("%sNamespace Size: %"PRIu64"\n",
-		TAB, (uint64_t)le64toh(ns->nsze));
-	printf("%sNamespace Capacity: %"PRIu64"\n",
-		TAB, (uint64_t)le64toh(ns->ncap));
-	printf("%sNamespace Utilization: %"PRIu64"\n",
-		TAB, (uint64_t)le64toh(ns->nuse));
-	printf("%sNVM Capacity: %"PRIu64"\n",
-		TAB, (uint64_t)le64toh(ns->nvmcap));
-}
-	
-/*
- * [dev:ns] device_file devtype size <vendor model revision>
- */
-void lsnvme_printbd(struct udev_device *dev, const char *tab)
-{
-	printf("[%s:%s]\t%s\t%s\t%s\t%s\t%s\t%s\n",
-		udev_device_get_sysnum(udev_device_get_parent(dev)),
-		udev_device_get_sysnum(dev),
-		udev_device_get_devnode(dev),
-		udev_device_get_devtype(dev),
-		bd_size(dev),
-		lsnvme_query_hwdb(dev, "ID_VENDOR"),
-		lsnvme_query_hwdb(dev, "ID_MODEL"),
-		lsnvme_query_hwdb(dev, "ID_REVISION")
-	);
+	char size[BD_SIZE_LEN];
 
-	if (opts.verbose) {
-		struct nvme_id_ns ns;
-		if(lsnvme_identify_ns(dev, &ns))
-			fprintf(stderr, "%sioctl failed on: %s\n",
-				TAB, udev_device_get_devnode(dev));
-		else
-			lsnvme_printctrl_ns(&ns);
+	if (opts.format != FMT_TEXT) {
+		out_ns(action, ns);
+		out_flush();
+		return;
 	}
+
+	if (ns->is_part)
+		printf("%s\t[%s:%s:%s]\t%s\t%s\t%s",
+			action, ns->ctrl_sysnum, ns->disk_sysnum, ns->sysnum,
+			ns->devnode, ns->devtype, bd_size(ns->sectors, size));
+	else
+		printf("%s\t[%s:%s]\t%s\t%s\t%s",
+			action, ns->ctrl_sysnum, ns->sysnum,
+			ns->devnode, ns->devtype, bd_size(ns->sectors, size));
+
+	if (opts.verbose && ns->id && !ns->id_ret)
+		printf("\tnsze=%"PRIu64" ncap=%"PRIu64" nuse=%"PRIu64,
+			(uint64_t)le64toh(ns->id->nsze),
+			(uint64_t)le64toh(ns->id->ncap),
+			(uint64_t)le64toh(ns->id->nuse));
+	else if (opts.verbose && ns->id)
+		printf("\tioctl failed");
+
+	printf("\n");
+	fflush(stdout);
 }
 
-/*
- * [dev:ns:pn] device_file devtype size (part type?)
- */
-void lsnvme_printpart(struct udev_device *dev, const char *tab)
+static struct lsnvme_ns *watch_find_ns(dev_t devnum, struct lsnvme_ctrl **owner)
 {
-	struct udev_device *parent = udev_device_get_parent(dev);
+	unsigned int i, n;
 
-	printf("[%s:%s:%s]\t%s\t%s\t%s\n",
-		udev_device_get_sysnum(udev_device_get_parent(parent)),
-		udev_device_get_sysnum(udev_device_get_parent(dev)),
-		udev_device_get_sysnum(dev),
-		udev_device_get_devnode(dev),
-		udev_device_get_devtype(dev),
-		bd_size(dev)
-	);
+	for (i = 0; i < nr_ctrls; ++i)
+		for (n = 0; n < ctrls[i].nr_ns; ++n)
+			if (ctrls[i].ns[n].dev &&
+			    udev_device_get_devnum(ctrls[i].ns[n].dev) == devnum) {
+				*owner = &ctrls[i];
+				return &ctrls[i].ns[n];
+			}
+
+	return NULL;
 }
 
-/*
- * [dev] device_file vendor  model  bus  driver (transport?)
- */
-void lsnvme_printctrl(struct udev_device *dev)
+static void watch_drop_ns(struct lsnvme_ctrl *ctrl, struct lsnvme_ns *ns)
 {
-	struct udev_device *pdev = udev_device_get_parent(dev);
-
-	printf("[%s]\t%s\t%s\t%s\t%s\t%s\n",
-		udev_device_get_sysnum(dev),
-		udev_device_get_devnode(dev),
-		lsnvme_query_hwdb(pdev, "ID_VENDOR_FROM_DATABASE"),
-		lsnvme_query_hwdb(pdev, "ID_MODEL_FROM_DATABASE"),
-		udev_device_get_subsystem(pdev),
-		find_driver(dev)
-	);
+	unsigned int idx = ns - ctrl->ns;
 
-	if (opts.verbose) {
-		struct nvme_id_ctrl id;
-		if(lsnvme_identify_ctrl(dev, &id))
-			fprintf(stderr, "%sioctl failed on: %s\n",
-				TAB, udev_device_get_devnode(dev));
-		else
-			lsnvme_printctrl_id(&id);
-	}
+	udev_device_unref(ns->dev);
+	free(ns->id);
+	memmove(ns, ns + 1, (ctrl->nr_ns - idx - 1) * sizeof(*ns));
+	--ctrl->nr_ns;
 }
 
-static int lsnvme_ls(char *path)
+static void watch_ctrl_event(const char *action, struct udev_device *dev)
 {
-	struct udev_device *dev = find_device(path);
-	const char *dt;
-	if (dev == NULL)
-		return EXIT_FAILURE;
+	struct lsnvme_ctrl *ctrl = lsnvme_find_ctrl(dev);
+	unsigned int n;
 
-	dt = udev_device_get_devtype(dev);
+	if (strcmp(action, "remove") == 0) {
+		if (!ctrl)
+			return;
+		if (opts.disp_ctrl)
+			watch_print_ctrl(action, ctrl);
 
-	if (strcmp(udev_device_get_subsystem(dev), NVME) == 0)
-		lsnvme_printctrl(dev);
-	else if (dt && strcmp(dt, "partition"))
-		lsnvme_printbd(dev, "");
-	else
-		lsnvme_printpart(dev, "");
+		for (n = 0; n < ctrl->nr_ns; ++n) {
+			udev_device_unref(ctrl->ns[n].dev);
+			free(ctrl->ns[n].id);
+		}
+		free(ctrl->ns);
+		free(ctrl->active);
+		free(ctrl->id);
+		lsnvme_dev_drop(ctrl->devnum);
+		udev_device_unref(ctrl->dev);
 
-	return EXIT_SUCCESS;
-}
+		memmove(ctrl, ctrl + 1,
+			(nr_ctrls - (ctrl - ctrls) - 1) * sizeof(*ctrl));
+		--nr_ctrls;
+		return;
+	}
 
+	if (ctrl) {
+		/* keep the namespaces, refresh everything read from sysfs */
+		struct lsnvme_ns *ns = ctrl->ns;
+		unsigned int nr_ns = ctrl->nr_ns;
 
-static int lsnvme_enum_devs(struct udev_device *parent)
-{
-	struct udev_enumerate *enum_children = udev_enumerate_new(udev);
-	struct udev_list_entry *devices, *dev_list_entry;
-	struct udev_device *cdev;
-	const char *path;
+		free(ctrl->id);
+		free(ctrl->active);
+		udev_device_unref(ctrl->dev);
+		lsnvme_ctrl_init(ctrl, udev_device_ref(dev));
+		ctrl->ns = ns;
+		ctrl->nr_ns = nr_ns;
+
+		for (n = 0; n < nr_ns; ++n) {
+			ns[n].ctrl_devnode = ctrl->devnode;
+			ns[n].ctrl_sysnum = ctrl->sysnum;
+			ns[n].ctrl_sn = ctrl->sn;
+			ns[n].ctrl_fr = ctrl->fr;
+			ns[n].ctrl_cntlid = ctrl->cntlid;
+		}
+	} else {
+		ctrl = lsnvme_add_ctrl();
+		if (!ctrl)
+			return;
+		lsnvme_ctrl_init(ctrl, udev_device_ref(dev));
+	}
 
-	udev_enumerate_add_match_parent(enum_children, parent);
+	if (!opts.disp_ctrl)
+		return;
 
-	udev_enumerate_scan_devices(enum_children);
-	devices = udev_enumerate_get_list_entry(enum_children);
+	if (opts.verbose)
+		lsnvme_identify_ctrl_one(ctrl);
+	watch_print_ctrl(action, ctrl);
+}
 
-	udev_list_entry_foreach(dev_list_entry, devices) {
-		path = udev_list_entry_get_name(dev_list_entry);
-		cdev = udev_device_new_from_syspath(udev, path);
-		const char *dt = udev_device_get_devtype(cdev);
+static void watch_block_event(const char *action, struct udev_device *dev)
+{
+	const char *dt = udev_device_get_devtype(dev);
+	struct udev_device *parent;
+	struct lsnvme_ctrl *ctrl;
+	struct lsnvme_ns *ns;
 
-		/* skip parent */
-		if (udev_device_get_devnum(cdev) ==
-		    udev_device_get_devnum(parent))
-			continue;
+	ns = watch_find_ns(udev_device_get_devnum(dev), &ctrl);
 
-		if (dt && strcmp(dt, "partition")) {
-			lsnvme_printbd(cdev, opts.disp_ctrl ? TAB : "");
-		} else {
-			lsnvme_printpart(cdev, "");
-		}
+	if (strcmp(action, "remove") == 0) {
+		if (!ns)
+			return;
+		if (opts.disp_devs)
+			watch_print_ns(action, ns);
+		watch_drop_ns(ctrl, ns);
+		return;
+	}
 
-		udev_device_unref(cdev);
+	if (ns) {
+		free(ns->id);
+		udev_device_unref(ns->dev);
+	} else {
+		parent = udev_device_get_parent(dev);
+		if (parent && !(dt && strcmp(dt, "partition")))
+			parent = udev_device_get_parent(parent);
+
+		ctrl = lsnvme_find_ctrl(parent);
+		if (!ctrl)
+			return;
+		ns = lsnvme_add_ns(ctrl);
+		if (!ns)
+			return;
 	}
 
-	udev_enumerate_unref(enum_children);
+	lsnvme_ns_init(ns, udev_device_ref(dev), ctrl->dev);
 
-	return EXIT_SUCCESS;
+	if (!opts.disp_devs)
+		return;
+
+	if (opts.verbose && !ns->is_part)
+		lsnvme_identify_ns_one(ns);
+	watch_print_ns(action, ns);
 }
 
-static int lsnvme_enum_ctrl(void)
+static int lsnvme_watch(void)
 {
-	struct udev_enumerate *enum_parents;
-	struct udev_list_entry *devices, *dev_list_entry;
+	struct udev_monitor *mon;
 	struct udev_device *dev;
-	const char *path;
+	struct pollfd pfd;
+	const char *action, *subsystem;
 
-	enum_parents = udev_enumerate_new(udev);
+	mon = udev_monitor_new_from_netlink(udev, "udev");
+	if (!mon) {
+		fprintf(stderr, "failed to create udev monitor\n");
+		return EXIT_FAILURE;
+	}
 
-	udev_enumerate_add_match_subsystem(enum_parents, NVME);
+	udev_monitor_filter_add_match_subsystem_devtype(mon, NVME, NULL);
+	udev_monitor_filter_add_match_subsystem_devtype(mon, "block", NULL);
 
-	udev_enumerate_scan_devices(enum_parents);
-	devices = udev_enumerate_get_list_entry(enum_parents);
-	udev_list_entry_foreach(dev_list_entry, devices) {
-		path = udev_list_entry_get_name(dev_list_entry);
-		dev = udev_device_new_from_syspath(udev, path);
+	/* subscribe first so nothing between listing and loop is lost */
+	if (udev_monitor_enable_receiving(mon) < 0) {
+		fprintf(stderr, "failed to receive udev events\n");
+		udev_monitor_unref(mon);
+		return EXIT_FAILURE;
+	}
 
-		if (opts.disp_ctrl)
-			lsnvme_printctrl(dev);
+	catch_stop_signals();
 
-		if (opts.disp_devs)
-			lsnvme_enum_devs(dev);
+	lsnvme_collect();
+	lsnvme_print_all();
+	out_flush();
+	fflush(stdout);
+
+	pfd.fd = udev_monitor_get_fd(mon);
+	pfd.events = POLLIN;
+
+	while (!stop) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		dev = udev_monitor_receive_device(mon);
+		if (!dev)
+			continue;
+
+		action = udev_device_get_action(dev);
+		subsystem = udev_device_get_subsystem(dev);
+
+		if (opts.cache_dir)
+			uevent_seqnum = udev_device_get_seqnum(dev);
+
+		if (action && subsystem &&
+		    strncmp(udev_device_get_sysname(dev), NVME,
+			    strlen(NVME)) == 0) {
+			if (strcmp(subsystem, NVME) == 0)
+				watch_ctrl_event(action, dev);
+			else
+				watch_block_event(action, dev);
+		}
 
 		udev_device_unref(dev);
 	}
 
-	udev_enumerate_unref(enum_parents);
+	udev_monitor_unref(mon);
+	lsnvme_free_ctrls();
 
 	return EXIT_SUCCESS;
 }
@@ -495,13 +6314,40 @@ static void lsnvme_get_mount_paths(void)
 
 	while ((fs = getmntent(fp)) != NULL)
 		if (strcmp(fs->mnt_type, "sysfs") == 0)
-			SYS = strdup(fs->mnt_dir);
+			SYS = intern(fs->mnt_dir);
 		else if (strcmp(fs->mnt_type, "devtmpfs") == 0)
-			DEV = strdup(fs->mnt_dir);
+			DEV = intern(fs->mnt_dir);
+		else if (strcmp(fs->mnt_type, "debugfs") == 0 && !DEBUGFS)
+			DEBUGFS = intern(fs->mnt_dir);
 
 	endmntent(fp);
 }
 
+/* long options without a short form */
+enum {
+	OPT_SYSFS = 0x100,
+	OPT_DEVFS,
+	OPT_MOCK,
+	OPT_PROBE,
+	OPT_QD_SWEEP,
+	OPT_ADMIN_STATS,
+	OPT_TIMEOUT,
+	OPT_DEADLINE,
+	OPT_MAX_INFLIGHT,
+	OPT_MAX_HOST_INFLIGHT,
+	OPT_RATE,
+	OPT_SPREAD,
+	OPT_ERRORS,
+	OPT_FIRMWARE,
+	OPT_POWER,
+	OPT_LBAF,
+	OPT_TOPOLOGY,
+	OPT_PROCFS,
+	OPT_TUNING,
+	OPT_IOSTAT,
+	OPT_HCTX,
+};
+
 static int version(const char *progr)
 {
 	fprintf(stdout, "%s: 0.2\n", progr);
@@ -539,12 +6385,41 @@ static void set_size(char size_spec)
 
 static struct option long_options[] = {
 	{"size",	required_argument, 0, 's'},
+	{"jobs",	required_argument, 0, 'j'},
+	{"active-ns",	no_argument, 0, 'A'},
+	{"backend",	required_argument, 0, 'B'},
+	{"cache",	optional_argument, 0, 'c'},
+	{"refresh",	no_argument, &opts.refresh, 1},
+	{"watch",	no_argument, 0, 'w'},
+	{"smart",	optional_argument, 0, 'S'},
 	{"host",	optional_argument, 0, 'H'},
 	{"tree",	no_argument, 0, 't'},
 	{"targets",	no_argument, 0, 'T'},
 	{"discover",	no_argument, 0, 'D'},
 	{"m",		no_argument, 0, 'm'},
+	{"format",	required_argument, 0, 'f'},
 	{"headers",	no_argument, &opts.headers, 1},
+	{"sysfs",	required_argument, 0, OPT_SYSFS},
+	{"devfs",	required_argument, 0, OPT_DEVFS},
+	{"procfs",	required_argument, 0, OPT_PROCFS},
+	{"mock",	optional_argument, 0, OPT_MOCK},
+	{"probe-latency", optional_argument, 0, OPT_PROBE},
+	{"qd-sweep",	optional_argument, 0, OPT_QD_SWEEP},
+	{"admin-stats",	optional_argument, 0, OPT_ADMIN_STATS},
+	{"timeout",	required_argument, 0, OPT_TIMEOUT},
+	{"deadline",	required_argument, 0, OPT_DEADLINE},
+	{"max-inflight", required_argument, 0, OPT_MAX_INFLIGHT},
+	{"max-host-inflight", required_argument, 0, OPT_MAX_HOST_INFLIGHT},
+	{"rate",	required_argument, 0, OPT_RATE},
+	{"spread",	required_argument, 0, OPT_SPREAD},
+	{"errors",	no_argument, 0, OPT_ERRORS},
+	{"firmware",	optional_argument, 0, OPT_FIRMWARE},
+	{"power",	no_argument, 0, OPT_POWER},
+	{"lbaf",	no_argument, 0, OPT_LBAF},
+	{"topology",	no_argument, 0, OPT_TOPOLOGY},
+	{"tuning",	optional_argument, 0, OPT_TUNING},
+	{"iostat",	optional_argument, 0, OPT_IOSTAT},
+	{"hctx",	no_argument, 0, OPT_HCTX},
 	{"version",	no_argument, 0, 'V'},
 	{"verbose",	no_argument, 0, 'v'},
 	{"help",	no_argument, 0, 'h'},
@@ -553,34 +6428,123 @@ static struct option long_options[] = {
 
 static const char *help_strings[][2] = {
 	{"SIZE",	"\tspecific size from [TGMKB], default: auto"},
+	{"N",		"\tquery at most N controllers in parallel"},
+	{"",		"list namespaces from Identify Active Namespace List"},
+	{"NAME",	"\tenumerate with 'udev' (default) or 'sysfs'"},
+	{"DIR",		"cache Identify data, default: /run/lsnvme"},
+	{"",		"\tignore cached Identify data and re-read it"},
+	{"",		"\tkeep running and print one line per device change"},
+	{"SECS",	"poll SMART logs and print rates, default: 1s,"
+			" e.g. -S5"},
 	{"",		"\tdisplay host(s) attached to this target system"},
 	{"",		"\tdisplay tree-like diagram if possible"},
 	{"",		"\tlist targets attached to this host (WIP)"},
 	{"",		"Go 'discover' resources available for a host (WIP)"},
 	{"",		"\tmachine readable output"},
+	{"FMT",		"\tmachine readable output as 'kv', 'json', 'csv' or 'bin'"},
 	{"",		"\tprint descriptive headers"},
+	{"DIR",		"\t\tuse DIR as sysfs root, implies --backend=sysfs"},
+	{"DIR",		"\t\tuse DIR as devfs root for device nodes"},
+	{"DIR",		"\t\tuse DIR as procfs root for IRQ affinities"},
+	{"SPEC",	"\tanswer admin commands from a mock controller"},
+	{"N",		"time N random reads per namespace, default: 1000"},
+	{"SECS",	"\tio_uring reads at QD 1..256, SECS per step, default: 1"},
+	{"N",		"admin round trip histograms, N: time N commands"},
+	{"MS",		"\t\tabandon admin commands taking longer than MS"},
+	{"SECS",	"\tstop sending admin commands after SECS"},
+	{"N",		"\tadmin commands in flight per controller"},
+	{"N",		"\tadmin commands in flight on the whole host"},
+	{"N[,BURST]",	"\tadmin commands per second, token bucket of BURST"},
+	{"SECS",	"\t\tstagger controllers across a window of SECS"},
+	{"",		"\tprint error log entries added since the last run"},
+	{"MODE",		"firmware slots, MODE 'slots' (default) or 'rollup'"},
+	{"",		"\tpower states, APST and worst-case wake latency"},
+	{"",		"\tLBA formats, flag namespaces not in the fastest one"},
+	{"",		"\tqueue to CPU, IRQ and NUMA node placement"},
+	{"FILE",		"check queue settings against a profile,"
+			" e.g. --tuning=FILE"},
+	{"SECS",		"per device I/O statistics, default: 1s,"
+			" e.g. --iostat=5"},
+	{"",		"\tper hardware queue traffic, flag imbalance"},
 	{"",		"\tdisplay version and exit"},
 	{"",		"\tincrease verbosity level"},
 	{"",		"\tdisplay this help and exit"},
 	{"", ""}
 };
 
+/*
+ * Optional arguments have to be attached (-S5, --smart=5): getopt leaves a
+ * separate "-S 5" to the operands, where the 5 would be looked up as a
+ * device. Catch a value that was most likely meant for the option, a
+ * number or, for file arguments, a regular file.
+ */
+static bool opt_detached(int argc, char *argv[], bool file)
+{
+	const char *next;
+	struct stat st;
+
+	if (optarg || optind >= argc)
+		return false;
+
+	next = argv[optind];
+	if (file)
+		return stat(next, &st) == 0 && S_ISREG(st.st_mode);
+
+	return *next && strspn(next, "0123456789.") == strlen(next);
+}
+
+/* a whole, non-negative number up to max */
+static bool opt_uint(const char *s, unsigned long max, unsigned long *v)
+{
+	char *end;
+
+	errno = 0;
+	if (!isdigit((unsigned char)*s))
+		return false;
+	*v = strtoul(s, &end, 0);
+
+	return !*end && !errno && *v <= max;
+}
+
+/* a positive number of seconds, fractions allowed, at most ~30 years */
+static bool opt_secs(const char *s, double *v)
+{
+	char *end;
+
+	*v = strtod(s, &end);
+	return end != s && !*end && *v > 0 && *v <= 1e9;
+}
+
+static int opt_attach_error(const char *progr, const char *opt,
+			    const char *value)
+{
+	fprintf(stderr, "%s: %s takes its value attached, as %s=%s\n",
+		progr, opt, opt, value);
+	return EXIT_FAILURE;
+}
+
 static int usage(const char *progr)
 {
 	const struct option *ptr = long_options;
 
 	printf("\nUsage: %s [<switches>] [ devices.. ]\n", progr);
 
-	for (int i = 0; ptr->name != NULL; ++i, ptr = &long_options[i])
+	for (int i = 0; ptr->name != NULL; ++i, ptr = &long_options[i]) {
+		if (ptr->flag || ptr->val >= OPT_SYSFS)
+			printf("  --%s", ptr->name);
+		else
+			printf("  -%c, --%s", ptr->val, ptr->name);
+
 		if (ptr->has_arg == required_argument)
-			printf("  -%c, --%s=%s%s\n", ptr->val, ptr->name,
-				help_strings[i][0], help_strings[i][1]);
-		else if (ptr->flag && ptr->val)
-			printf("  --%s\t%s\n", ptr->name,
-				help_strings[i][1]);
+			printf("=%s%s\n", help_strings[i][0],
+			       help_strings[i][1]);
+		else if (ptr->has_arg == optional_argument &&
+			 help_strings[i][0][0])
+			printf("[=%s]\t%s\n", help_strings[i][0],
+			       help_strings[i][1]);
 		else
-			printf("  -%c, --%s\t%s\n", ptr->val, ptr->name,
-				help_strings[i][1]);
+			printf("\t%s\n", help_strings[i][1]);
+	}
 
 	printf("\n");
 	return EXIT_SUCCESS;
@@ -589,17 +6553,139 @@ static int usage(const char *progr)
 int main(int argc, char *argv[])
 {
 	int opt, option_index, ret = EXIT_SUCCESS;
+	unsigned long num;
 
-	while ((opt = getopt_long(argc, argv, "s:DHTtmVvh",
+	while ((opt = getopt_long(argc, argv, "s:j:AB:c::wS::DHTtmf:Vvh",
 				  long_options, &option_index)) != -1) {
 		switch (opt) {
-		case 0: /* longopt only, may not be used */
-			printf("option: %s\n", long_options[option_index].name);
-			printf("%d\n", opts.headers);
+		case 0: /* longopt only, flag already set */
+			break;
+		case OPT_SYSFS:
+			opts.sys_root = optarg;
+			break;
+		case OPT_PROCFS:
+			opts.proc_root = optarg;
+			break;
+		case OPT_DEVFS:
+			opts.dev_root = optarg;
+			break;
+		case OPT_MOCK:
+			if (mock_parse(optarg))
+				return usage(argv[0]);
+			break;
+		case OPT_PROBE:
+			opts.probe_reads = optarg ? strtoul(optarg, NULL, 0) :
+						    1000;
+			if (opts.probe_reads == 0)
+				opts.probe_reads = 1;
+			break;
+		case OPT_ADMIN_STATS:
+			opts.admin_stats = true;
+			opts.admin_loop = optarg ? strtoul(optarg, NULL, 0) : 0;
+			break;
+		case OPT_TIMEOUT:
+			if (!opt_uint(optarg, UINT_MAX, &num) || !num)
+				return usage(argv[0]);
+			opts.timeout_ms = num;
+			break;
+		case OPT_DEADLINE:
+			if (!opt_secs(optarg, &opts.deadline))
+				return usage(argv[0]);
+			break;
+		case OPT_MAX_INFLIGHT:
+			opts.ctrl_inflight = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_MAX_HOST_INFLIGHT:
+			opts.host_inflight = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_RATE: {
+			char *end;
+
+			opts.rate = strtod(optarg, &end);
+			opts.burst = *end == ',' ? strtod(end + 1, NULL) : 0;
+			if (opts.burst < 1)
+				opts.burst = opts.rate > 1 ? opts.rate : 1;
+			break;
+		}
+		case OPT_SPREAD:
+			opts.spread = strtod(optarg, NULL);
+			break;
+		case OPT_ERRORS:
+			opts.errors = true;
+			break;
+		case OPT_HCTX:
+			opts.hctx = true;
+			break;
+		case OPT_IOSTAT:
+			if (opt_detached(argc, argv, false))
+				return opt_attach_error(argv[0], "--iostat",
+							argv[optind]);
+			opts.iostat_interval = optarg ? strtod(optarg, NULL) : 1;
+			if (opts.iostat_interval <= 0)
+				opts.iostat_interval = 1;
+			break;
+		case OPT_TUNING:
+			if (opt_detached(argc, argv, true))
+				return opt_attach_error(argv[0], "--tuning",
+							argv[optind]);
+			opts.tuning = true;
+			opts.tune_profile = optarg;
+			break;
+		case OPT_TOPOLOGY:
+			opts.topology = true;
+			break;
+		case OPT_LBAF:
+			opts.lbaf = true;
+			break;
+		case OPT_POWER:
+			opts.power = true;
+			break;
+		case OPT_FIRMWARE:
+			if (!optarg || strcmp(optarg, "slots") == 0)
+				opts.firmware = FW_SLOTS;
+			else if (strcmp(optarg, "rollup") == 0)
+				opts.firmware = FW_ROLLUP;
+			else
+				return usage(argv[0]);
+			break;
+		case OPT_QD_SWEEP:
+			opts.qd_secs = optarg ? strtod(optarg, NULL) : 1;
+			if (opts.qd_secs <= 0)
+				opts.qd_secs = 1;
 			break;
 		case 's':
 			set_size(optarg[0]);
 			break;
+		case 'j':
+			if (!opt_uint(optarg, UINT_MAX, &num))
+				return usage(argv[0]);
+			opts.jobs = num ? num : 1;
+			break;
+		case 'A':
+			opts.active_ns = true;
+			break;
+		case 'B':
+			if (strcmp(optarg, "sysfs") == 0)
+				opts.backend = BACKEND_SYSFS;
+			else if (strcmp(optarg, "udev") == 0)
+				opts.backend = BACKEND_UDEV;
+			else
+				return usage(argv[0]);
+			break;
+		case 'c':
+			opts.cache_dir = optarg ? optarg : "/run/lsnvme";
+			break;
+		case 'w':
+			opts.watch = true;
+			break;
+		case 'S':
+			if (opt_detached(argc, argv, false))
+				return opt_attach_error(argv[0], "--smart",
+							argv[optind]);
+			opts.smart_interval = optarg ? strtod(optarg, NULL) : 1;
+			if (opts.smart_interval <= 0)
+				opts.smart_interval = 1;
+			break;
 		case 'H':
 			opts.disp_ctrl = true;
 			opts.disp_devs = false;
@@ -608,7 +6694,20 @@ int main(int argc, char *argv[])
 			opts.disp_tree = true;
 			break;
 		case 'm':
-			opts.disp_machine = true;
+			if (opts.format == FMT_TEXT)
+				opts.format = FMT_KV;
+			break;
+		case 'f':
+			if (strcmp(optarg, "kv") == 0)
+				opts.format = FMT_KV;
+			else if (strcmp(optarg, "json") == 0)
+				opts.format = FMT_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				opts.format = FMT_CSV;
+			else if (strcmp(optarg, "bin") == 0)
+				opts.format = FMT_BIN;
+			else
+				return usage(argv[0]);
 			break;
 		case 'V':
 			return version(argv[0]);
@@ -636,6 +6735,60 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* mock data keyed by real serial numbers would poison the cache */
+	if (transport != &ioctl_transport && opts.cache_dir) {
+		fprintf(stderr, "%s: --mock data cannot be cached, drop "
+			"--cache\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* libudev always reads the real /sys */
+	if (opts.sys_root && opts.backend == BACKEND_UDEV) {
+		fprintf(stderr, "%s: --sysfs needs the sysfs backend, not "
+			"-B udev\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (opts.backend == BACKEND_AUTO)
+		opts.backend = opts.sys_root ? BACKEND_SYSFS : BACKEND_UDEV;
+
+	/* events arrive as udev devices, so watch mode needs udev */
+	if (opts.watch && (opts.backend == BACKEND_SYSFS || opts.sys_root)) {
+		fprintf(stderr, "%s: --watch follows udev and cannot use "
+			"the sysfs backend or --sysfs\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (opts.format == FMT_BIN) {
+		if (optind < argc || opts.smart_interval || opts.watch ||
+		    opts.probe_reads || opts.qd_secs || opts.admin_loop ||
+		    opts.errors || opts.firmware >= 0 || opts.power ||
+		    opts.lbaf || opts.topology || opts.tuning ||
+		    opts.iostat_interval || opts.hctx) {
+			fprintf(stderr, "%s: binary snapshots cover all "
+				"devices and cannot be streamed\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		if (opts.admin_stats) {
+			fprintf(stderr, "%s: --admin-stats would follow the "
+				"binary snapshot on stdout\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		if (isatty(STDOUT_FILENO)) {
+			fprintf(stderr, "%s: not writing a binary snapshot "
+				"to a terminal\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		/* a snapshot always carries controllers, namespaces and
+		 * whatever Identify data can be read */
+		opts.disp_ctrl = true;
+		opts.disp_devs = true;
+		if (!opts.verbose)
+			opts.verbose = 1;
+	}
+
+	if (opts.deadline > 0)
+		deadline_ns = mono_ns() + (uint64_t)(opts.deadline * 1e9);
+
 	udev = udev_new();
 
 	if (udev == NULL) {
@@ -645,6 +6798,21 @@ int main(int argc, char *argv[])
 		lsnvme_get_mount_paths();
 	}
 
+	if (opts.sys_root) {
+		char debugfs[PATH_MAX];
+
+		SYS = opts.sys_root;
+		snprintf(debugfs, sizeof(debugfs), "%s/kernel/debug", SYS);
+		DEBUGFS = intern(debugfs);
+	}
+	if (opts.dev_root)
+		DEV = opts.dev_root;
+	if (opts.proc_root)
+		PROC = opts.proc_root;
+
+	if (opts.cache_dir)
+		cache_init();
+
 	/* if given a list of devices, print them, otherwise
  	 * print all controllers */
 	if (optind < argc) {
@@ -653,10 +6821,54 @@ int main(int argc, char *argv[])
 				fprintf(stderr, 
 					"%s: unable to get info for: %s\n",
 					argv[0], argv[optind-1]);
+	} else if (opts.smart_interval) {
+		ret = lsnvme_smart();
+	} else if (opts.probe_reads) {
+		ret = lsnvme_probe();
+	} else if (opts.qd_secs) {
+		ret = lsnvme_qd_sweep();
+	} else if (opts.admin_loop) {
+		ret = lsnvme_admin_loop();
+	} else if (opts.errors) {
+		ret = lsnvme_errors();
+	} else if (opts.firmware >= 0) {
+		ret = lsnvme_firmware();
+	} else if (opts.power) {
+		ret = lsnvme_power();
+	} else if (opts.lbaf) {
+		ret = lsnvme_lbaf();
+	} else if (opts.topology) {
+		ret = lsnvme_topology();
+	} else if (opts.tuning) {
+		ret = lsnvme_tuning();
+	} else if (opts.iostat_interval) {
+		ret = lsnvme_iostat();
+	} else if (opts.hctx) {
+		ret = lsnvme_hctx();
+	} else if (opts.watch) {
+		ret = lsnvme_watch();
 	} else {
 		ret = lsnvme_enum_ctrl();
 	}
 
+	out_flush();
+	free(out.buf);
+
+	/*
+	 * Abandoned commands can keep the process around until the driver
+	 * gives up; at least let whoever reads our output see EOF now.
+	 */
+	if (abandoned) {
+		fprintf(stderr, "%s: %u admin command(s) timed out\n",
+			argv[0], abandoned);
+		fflush(stdout);
+		close(STDOUT_FILENO);
+	}
+
+	lsnvme_dev_close_all();
+	if (hwdb)
+		udev_hwdb_unref(hwdb);
 	udev_unref(udev);
+	arena_free();
 	return ret;
 }
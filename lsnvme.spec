@@ -30,6 +30,7 @@ rm -rf %{buildroot}
 %defattr(-,root,root,-)
 %{_bindir}/%{name}
 %{_mandir}/man8/%{name}.8.gz
+%{_includedir}/lsnvme_snap.h
 %doc AUTHORS COPYING README.md
 %doc %{_datadir}/doc/%{name}-%{version}/*
 
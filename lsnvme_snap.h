@@ -0,0 +1,252 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Binary snapshot written by `lsnvme -f bin`, plus a small header-only
+ * reader that works directly on a mapping of the file without copying.
+ *
+ * Layout, every section 8-byte aligned, all integers little endian:
+ *
+ *	struct lsnvme_snap_hdr
+ *	struct lsnvme_snap_ctrl		[nr_ctrls]
+ *	struct lsnvme_snap_ns		[nr_ns]
+ *	raw Identify pages		4096 bytes each
+ *	string pool			NUL terminated, offset 0 is ""
+ *
+ * Namespaces (and their partitions) of a controller are stored
+ * contiguously, starting at first_ns. Offsets are from the start of the
+ * file; a zero id_off means no Identify data was collected.
+ *
+ * The accessors below convert header fields to host byte order.
+ * Controller and namespace records point into the file as stored, so their
+ * numeric fields are read through lsnvme_snap_le32/le64. lsnvme_snap_str
+ * and lsnvme_snap_page take offsets exactly as stored.
+ *
+ *	struct lsnvme_snap snap;
+ *
+ *	if (lsnvme_snap_map(&snap, "host.snap") == 0) {
+ *		for (i = 0; i < lsnvme_snap_nr_ctrls(&snap); ++i) {
+ *			const struct lsnvme_snap_ctrl *c =
+ *				lsnvme_snap_ctrl(&snap, i);
+ *			const struct nvme_id_ctrl *id =
+ *				lsnvme_snap_page(&snap, c->id_off);
+ *			uint32_t nr_ns = lsnvme_snap_le32(c->nr_ns);
+ *			...
+ *		}
+ *		lsnvme_snap_unmap(&snap);
+ *	}
+ */
+
+#ifndef _LSNVME_SNAP_H
+#define _LSNVME_SNAP_H
+
+#include <endian.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LSNVME_SNAP_MAGIC	"LSNVSNAP"
+#define LSNVME_SNAP_VERSION	1
+#define LSNVME_SNAP_PAGE	4096
+
+enum {
+	LSNVME_SNAP_PART	= 1 << 0,	/* partition of a namespace */
+	LSNVME_SNAP_NO_BLKDEV	= 1 << 1,	/* active NSID, no block device */
+};
+
+struct lsnvme_snap_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	hdr_size;	/* readers skip what they don't know */
+	uint64_t	file_size;
+	uint64_t	created;	/* seconds since the epoch */
+	uint32_t	nr_ctrls;
+	uint32_t	nr_ns;
+	uint64_t	ctrl_off;
+	uint64_t	ns_off;
+	uint64_t	str_off;
+	uint64_t	str_size;
+	char		hostname[64];
+};
+
+struct lsnvme_snap_ctrl {
+	uint32_t	instance;	/* N of /dev/nvmeN */
+	uint32_t	first_ns;
+	uint32_t	nr_ns;
+	uint32_t	rsvd;
+	uint64_t	devnum;
+	uint64_t	id_off;		/* struct nvme_id_ctrl */
+	/* string pool offsets */
+	uint32_t	devnode;
+	uint32_t	vendor;
+	uint32_t	model;
+	uint32_t	bus;
+	uint32_t	driver;
+	uint32_t	serial;
+	uint32_t	firmware;
+	uint32_t	model_number;
+};
+
+struct lsnvme_snap_ns {
+	uint32_t	ctrl;		/* index into the controller table */
+	uint32_t	nsid;
+	uint32_t	instance;	/* M of nvmeNnM */
+	uint32_t	partno;		/* 0 for namespaces */
+	uint32_t	flags;
+	uint32_t	devnode;	/* string pool offset */
+	uint64_t	size;		/* bytes, UINT64_MAX if unknown */
+	uint64_t	id_off;		/* struct nvme_id_ns */
+};
+
+struct lsnvme_snap {
+	const unsigned char		*base;
+	size_t				size;
+	const struct lsnvme_snap_hdr	*hdr;
+};
+
+static inline uint32_t lsnvme_snap_le32(uint32_t v)
+{
+	return le32toh(v);
+}
+
+static inline uint64_t lsnvme_snap_le64(uint64_t v)
+{
+	return le64toh(v);
+}
+
+static inline int lsnvme_snap_range(const struct lsnvme_snap *s,
+				    uint64_t off, uint64_t len)
+{
+	return off <= s->size && len <= s->size - off && !(off & 7);
+}
+
+/* validate a snapshot that is already in memory; nothing is copied */
+static inline int lsnvme_snap_open(struct lsnvme_snap *s, const void *base,
+				   size_t size)
+{
+	const struct lsnvme_snap_hdr *h = base;
+
+	s->base = base;
+	s->size = size;
+	s->hdr = h;
+
+	if (size < sizeof(*h) ||
+	    memcmp(h->magic, LSNVME_SNAP_MAGIC, sizeof(h->magic)) ||
+	    le32toh(h->version) != LSNVME_SNAP_VERSION ||
+	    le32toh(h->hdr_size) < sizeof(*h) || le64toh(h->file_size) > size)
+		return -1;
+
+	if (!lsnvme_snap_range(s, le64toh(h->ctrl_off),
+			       (uint64_t)le32toh(h->nr_ctrls) *
+			       sizeof(struct lsnvme_snap_ctrl)) ||
+	    !lsnvme_snap_range(s, le64toh(h->ns_off),
+			       (uint64_t)le32toh(h->nr_ns) *
+			       sizeof(struct lsnvme_snap_ns)) ||
+	    !lsnvme_snap_range(s, le64toh(h->str_off), le64toh(h->str_size)) ||
+	    h->str_size == 0 ||
+	    s->base[le64toh(h->str_off) + le64toh(h->str_size) - 1] != 0)
+		return -1;
+
+	return 0;
+}
+
+static inline int lsnvme_snap_map(struct lsnvme_snap *s, const char *path)
+{
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	if (lsnvme_snap_open(s, base, st.st_size)) {
+		munmap(base, st.st_size);
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline void lsnvme_snap_unmap(struct lsnvme_snap *s)
+{
+	munmap((void *)s->base, s->size);
+	s->base = NULL;
+}
+
+static inline uint32_t lsnvme_snap_nr_ctrls(const struct lsnvme_snap *s)
+{
+	return le32toh(s->hdr->nr_ctrls);
+}
+
+static inline uint32_t lsnvme_snap_nr_ns(const struct lsnvme_snap *s)
+{
+	return le32toh(s->hdr->nr_ns);
+}
+
+static inline const struct lsnvme_snap_ctrl *
+lsnvme_snap_ctrl(const struct lsnvme_snap *s, uint32_t i)
+{
+	if (i >= le32toh(s->hdr->nr_ctrls))
+		return NULL;
+
+	return (const struct lsnvme_snap_ctrl *)
+		(s->base + le64toh(s->hdr->ctrl_off)) + i;
+}
+
+static inline const struct lsnvme_snap_ns *
+lsnvme_snap_ns(const struct lsnvme_snap *s, uint32_t i)
+{
+	if (i >= le32toh(s->hdr->nr_ns))
+		return NULL;
+
+	return (const struct lsnvme_snap_ns *)
+		(s->base + le64toh(s->hdr->ns_off)) + i;
+}
+
+/* "" for unset strings, NULL for a corrupt offset */
+static inline const char *lsnvme_snap_str(const struct lsnvme_snap *s,
+					  uint32_t off)
+{
+	off = le32toh(off);
+	if (off >= le64toh(s->hdr->str_size))
+		return NULL;
+
+	return (const char *)s->base + le64toh(s->hdr->str_off) + off;
+}
+
+/* a raw 4096 byte Identify page, NULL if absent */
+static inline const void *lsnvme_snap_page(const struct lsnvme_snap *s,
+					   uint64_t off)
+{
+	off = le64toh(off);
+	if (!off || !lsnvme_snap_range(s, off, LSNVME_SNAP_PAGE))
+		return NULL;
+
+	return s->base + off;
+}
+
+#endif /* _LSNVME_SNAP_H */